@@ -0,0 +1,78 @@
+/*
+ * alloc.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+
+/*
+The cache is uncollectable so the lists are traced and it is not collected
+while the thread uses it, the key only frees it at thread exit.
+*/
+static __thread tvm_gc_cache_t* tvm_gc_cache;
+
+static pthread_key_t tvm_gc_cache_key;
+static pthread_once_t tvm_gc_cache_once = PTHREAD_ONCE_INIT;
+
+static void tvm_gc_cache_free
+    (void* cache)
+{
+    GC_free(cache);
+}
+
+static void tvm_gc_cache_key_create
+    (void)
+{
+    pthread_key_create(&tvm_gc_cache_key, &tvm_gc_cache_free);
+}
+
+tvm_gc_cache_t* tvm_gc_thread_cache
+    (void)
+{
+    if(tvm_gc_cache == NULL)
+    {
+        pthread_once(&tvm_gc_cache_once, &tvm_gc_cache_key_create);
+
+        tvm_gc_cache = GC_malloc_uncollectable(sizeof(tvm_gc_cache_t));
+        pthread_setspecific(tvm_gc_cache_key, tvm_gc_cache);
+    }
+
+    return tvm_gc_cache;
+}
+
+void* tvm_gc_refill
+    (void** list, jit_nuint granules, jit_int kind)
+{
+    //one byte less so that the collector rounds it to the same granules with or without the extra byte
+    GC_generic_malloc_many(GC_RAW_BYTES_FROM_INDEX(granules) - 1, kind, list);
+
+    void* result = *list;
+    if(result == NULL)
+        return kind == GC_I_NORMAL ? GC_malloc(GC_RAW_BYTES_FROM_INDEX(granules) - 1) : GC_malloc_atomic(GC_RAW_BYTES_FROM_INDEX(granules) - 1);
+
+    //objects are cleared except the link
+    *list = GC_NEXT(result);
+    if(kind == GC_I_NORMAL)
+        GC_NEXT(result) = NULL;
+    return result;
+}
@@ -0,0 +1,106 @@
+/*
+ * map_bench.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+/*
+Microbenchmark of tvm_map_add and tvm_map_get with 10 to 1M keys.
+Keys look like the symbols exported by generated libraries.
+*/
+
+#include "tvm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_KEYS 1000000
+
+static double now_ns
+    (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main
+    (void)
+{
+    char** keys = jit_malloc(sizeof(char*) * MAX_KEYS);
+
+    int i;
+    for(i = 0; i < MAX_KEYS; ++i)
+    {
+        keys[i] = jit_malloc(32);
+        snprintf(keys[i], 32, "module_func_%d", i);
+    }
+
+    printf("%10s %14s %14s %14s\n", "keys", "add ns/op", "get ns/op", "miss ns/op");
+
+    int n;
+    for(n = 10; n <= MAX_KEYS; n *= 10)
+    {
+        //start from the default modules map size to measure growth too
+        tvm_map_t map = tvm_map_create(16);
+
+        double t0 = now_ns();
+        for(i = 0; i < n; ++i)
+            tvm_map_add(map, keys[i], keys[i]);
+        double t1 = now_ns();
+
+        //repeat lookups on small maps to get a stable measure
+        int rounds = MAX_KEYS / n;
+        int r;
+        for(r = 0; r < rounds; ++r)
+        {
+            for(i = 0; i < n; ++i)
+            {
+                if(tvm_map_get(map, keys[i]) != keys[i])
+                {
+                    fprintf(stderr, "map error! key %s not found.\n", keys[i]);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        double t2 = now_ns();
+
+        //lookups of a key that is never added
+        for(r = 0; r < rounds; ++r)
+            for(i = 0; i < n; ++i)
+                tvm_map_get(map, "module_func_missing");
+        double t3 = now_ns();
+
+        printf("%10d %14.2f %14.2f %14.2f\n", n,
+            (t1 - t0) / n,
+            (t2 - t1) / ((double)n * rounds),
+            (t3 - t2) / ((double)n * rounds));
+
+        tvm_map_free(map);
+    }
+
+    for(i = 0; i < MAX_KEYS; ++i)
+        jit_free(keys[i]);
+    jit_free(keys);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,423 @@
+/*
+ * module_gen.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+/*
+Generator of large synthetic modules for scaling tests of the loader, the linker
+and the compiler. It writes <name>.tripel and, with -l N, N libraries lib_<i>.tripel
+with the same shape whose symbols are all imported by the main module.
+
+usage: tvm-gen [-o dir] [-n name] [-s strings] [-t structs] [-g globals]
+               [-c natives] [-f functions] [-b body ops] [-l libraries]
+
+Counts are clamped to the jit_ushort limits, imports are clamped so that
+the totals of external symbols fit too.
+*/
+
+#include "tvm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USHORT_MAX 65535
+
+/*Natives from libc, abs must be the first because function bodies call it*/
+struct gen_native
+{
+    const char* name;
+    uint8_t ret;
+    uint8_t param;//TYPEID_POINTER means char*
+};
+
+#define GEN_NATIVE_ATTRIBUTES (TVM_NATIVE_NOTHROW | TVM_NATIVE_PURE | TVM_NATIVE_LEAF)
+
+static struct gen_native natives_table[] = {
+    { "abs", TYPEID_INT, TYPEID_INT },
+    { "labs", TYPEID_LONG, TYPEID_LONG },
+    { "atoi", TYPEID_INT, TYPEID_POINTER },
+    { "strlen", TYPEID_ULONG, TYPEID_POINTER },
+    { "toupper", TYPEID_INT, TYPEID_INT },
+    { "tolower", TYPEID_INT, TYPEID_INT },
+    { "isdigit", TYPEID_INT, TYPEID_INT },
+    { "isalpha", TYPEID_INT, TYPEID_INT }
+};
+
+#define NATIVES_TABLE_LEN (sizeof(natives_table) / sizeof(natives_table[0]))
+
+struct gen_config
+{
+    const char* dir;
+    const char* name;
+    long strings;
+    long structs;
+    long globals;
+    long natives;
+    long funcs;
+    long body;
+    long libs;
+};
+
+static uint16_t clamp
+    (long v)
+{
+    if(v < 0)
+        return 0;
+    return v > USHORT_MAX ? USHORT_MAX : (uint16_t)v;
+}
+
+static void write_strings
+    (writer_t w, uint16_t num)
+{
+    char buf[32];
+    writer_u16(w, num);
+
+    uint16_t i;
+    for(i = 0; i < num; ++i)
+    {
+        snprintf(buf, sizeof(buf), "str_%u", i);
+        writer_name(w, buf);
+    }
+}
+
+/*Struct i has an int, a double and a pointer to struct i - 1*/
+static void write_structs
+    (writer_t w, uint16_t num)
+{
+    char buf[32];
+    writer_u16(w, num);
+
+    uint16_t i;
+    for(i = 0; i < num; ++i)
+    {
+        snprintf(buf, sizeof(buf), "struct_%u", i);
+        writer_name(w, buf);
+
+        writer_u16(w, i == 0 ? 2 : 3);
+        writer_name(w, "a");
+        writer_u8(w, TYPEID_INT);
+        writer_name(w, "b");
+        writer_u8(w, TYPEID_DOUBLE);
+
+        if(i != 0)
+        {
+            writer_name(w, "next");
+            writer_u8(w, TYPEID_POINTER);
+            writer_u8(w, TYPEID_STRUCT);
+            writer_u16(w, i - 1);
+        }
+    }
+}
+
+/*Globals with even index are int, the function bodies store into global 0*/
+static void write_globals
+    (writer_t w, uint16_t num, uint16_t structs_num)
+{
+    char buf[32];
+    writer_u16(w, num);
+
+    uint16_t i;
+    for(i = 0; i < num; ++i)
+    {
+        snprintf(buf, sizeof(buf), "global_%u", i);
+        writer_name(w, buf);
+
+        if(i % 2 == 0 || structs_num == 0)
+            writer_u8(w, TYPEID_INT);
+        else
+        {
+            writer_u8(w, TYPEID_POINTER);
+            writer_u8(w, TYPEID_STRUCT);
+            writer_u16(w, i % structs_num);
+        }
+    }
+}
+
+/*Natives cycle over natives_table, repeated names resolve to the first one*/
+static void write_natives
+    (writer_t w, uint16_t num)
+{
+    writer_u16(w, num);
+
+    if(num == 0)
+    {
+        writer_u16(w, 0);
+        return;
+    }
+
+    writer_u16(w, 1);
+    writer_name(w, "libc.so.6");
+    writer_u16(w, num);
+
+    uint16_t i;
+    for(i = 0; i < num; ++i)
+    {
+        struct gen_native* n = natives_table + (i % NATIVES_TABLE_LEN);
+        writer_name(w, n->name);
+        writer_u8(w, n->ret);
+        writer_u16(w, 1);
+
+        writer_u8(w, n->param);
+        if(n->param == TYPEID_POINTER)
+            writer_u8(w, TYPEID_SBYTE);
+
+        writer_u8(w, GEN_NATIVE_ATTRIBUTES);
+    }
+}
+
+/*
+Body of func_<i>, int(int, int). It mixes the arguments with arithmetic and
+calls the previous function, abs, the same function of the first library and
+stores into global 0, so every kind of symbol is resolved by the compiler.
+*/
+static void write_body
+    (writer_t w, uint16_t i, struct gen_config* cfg, uint16_t globals_num, uint16_t natives_num, uint16_t ext_funcs_num)
+{
+    static const uint8_t ops[] = { OP_ADD, OP_SUB, OP_MUL, OP_XOR, OP_AND, OP_OR };
+
+    writer_t code = writer_create();
+
+    writer_op_u16(code, OP_DECL_I32, 0);
+    writer_u8(code, OP_PUSH_ARG_0);
+    writer_u8(code, OP_STORE_0);
+
+    long k;
+    for(k = 0; k < cfg->body; ++k)
+    {
+        switch(k % 8)
+        {
+            case 3:
+            if(i != 0)
+            {
+                writer_u8(code, OP_PUSH_0);
+                writer_u8(code, OP_PUSH_ARG_1);
+                writer_op_u16(code, OP_CALL, i - 1);
+                writer_u8(code, OP_STORE_0);
+                break;
+            }
+            //fall through
+
+            case 5:
+            if(natives_num != 0)
+            {
+                writer_u8(code, OP_PUSH_0);
+                writer_op_u16(code, OP_N_CALL, 0);
+                writer_u8(code, OP_STORE_0);
+                break;
+            }
+            //fall through
+
+            case 6:
+            if(i < ext_funcs_num)
+            {
+                writer_u8(code, OP_PUSH_0);
+                writer_u8(code, OP_PUSH_ARG_1);
+                writer_op_u16(code, OP_E_CALL, i);
+                writer_u8(code, OP_STORE_0);
+                break;
+            }
+            //fall through
+
+            case 7:
+            if(globals_num != 0)
+            {
+                writer_u8(code, OP_PUSH_0);
+                writer_op_u16(code, OP_STORE_GBL, 0);
+                break;
+            }
+            //fall through
+
+            default:
+            writer_u8(code, OP_PUSH_0);
+            writer_u8(code, OP_PUSH_ARG_1);
+            writer_u8(code, ops[k % sizeof(ops)]);
+            writer_u8(code, OP_STORE_0);
+        }
+    }
+
+    writer_u8(code, OP_PUSH_0);
+    writer_u8(code, OP_RET);
+
+    writer_body(w, 4, 1, 0, code);
+    writer_free(code);
+}
+
+static void write_funcs
+    (writer_t w, struct gen_config* cfg, uint16_t num, uint16_t globals_num, uint16_t natives_num, uint16_t ext_funcs_num)
+{
+    char buf[32];
+    writer_u16(w, num);
+
+    uint16_t i;
+    for(i = 0; i < num; ++i)
+    {
+        snprintf(buf, sizeof(buf), "func_%u", i);
+        writer_name(w, buf);
+
+        writer_u8(w, TYPEID_INT);
+        writer_u16(w, 2);
+        writer_u8(w, TYPEID_INT);
+        writer_u8(w, TYPEID_INT);
+
+        write_body(w, i, cfg, globals_num, natives_num, ext_funcs_num);
+    }
+}
+
+/*Write a list of names prefix_<i>, i in [0, num)*/
+static void write_names
+    (writer_t w, const char* prefix, uint16_t num)
+{
+    char buf[32];
+    writer_u16(w, num);
+
+    uint16_t i;
+    for(i = 0; i < num; ++i)
+    {
+        snprintf(buf, sizeof(buf), "%s_%u", prefix, i);
+        writer_name(w, buf);
+    }
+}
+
+static int write_module
+    (struct gen_config* cfg, const char* name, int is_lib)
+{
+    uint16_t strings = clamp(cfg->strings);
+    uint16_t structs = clamp(cfg->structs);
+    uint16_t globals = clamp(cfg->globals);
+    uint16_t natives = clamp(cfg->natives);
+    uint16_t funcs = clamp(cfg->funcs);
+
+    //imports of each library, totals must fit an ushort
+    uint16_t libs = is_lib ? 0 : clamp(cfg->libs);
+    uint16_t per_lib_structs = libs ? clamp(structs < USHORT_MAX / libs ? structs : USHORT_MAX / libs) : 0;
+    uint16_t per_lib_globals = libs ? clamp(globals < USHORT_MAX / libs ? globals : USHORT_MAX / libs) : 0;
+    uint16_t per_lib_natives = libs ? clamp(natives < USHORT_MAX / libs ? natives : USHORT_MAX / libs) : 0;
+    uint16_t per_lib_funcs = libs ? clamp(funcs < USHORT_MAX / libs ? funcs : USHORT_MAX / libs) : 0;
+
+    writer_t w = writer_create();
+    writer_header(w);
+
+    write_strings(w, strings);
+    write_structs(w, structs);
+    write_globals(w, globals, structs);
+    write_natives(w, natives);
+
+    //start returns 0
+    writer_t start = writer_create();
+    writer_op_i32(start, OP_LD_I32, 0);
+    writer_u8(start, OP_RET);
+    writer_body(w, 1, 0, 0, start);
+    writer_free(start);
+
+    //functions of the main module call the functions of the first library
+    write_funcs(w, cfg, funcs, globals, natives, libs ? per_lib_funcs : 0);
+
+    writer_u16(w, per_lib_structs * libs);
+    writer_u16(w, per_lib_globals * libs);
+    writer_u16(w, per_lib_natives * libs);
+    writer_u16(w, per_lib_funcs * libs);
+
+    writer_u16(w, libs);
+
+    uint16_t l;
+    for(l = 0; l < libs; ++l)
+    {
+        char lib_name[32];
+        snprintf(lib_name, sizeof(lib_name), "lib_%u", l);
+        writer_name(w, lib_name);
+
+        write_names(w, "struct", per_lib_structs);
+        write_names(w, "global", per_lib_globals);
+
+        //native names repeat with the table
+        writer_u16(w, per_lib_natives);
+        uint16_t i;
+        for(i = 0; i < per_lib_natives; ++i)
+            writer_name(w, natives_table[i % NATIVES_TABLE_LEN].name);
+
+        write_names(w, "func", per_lib_funcs);
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.tripel", cfg->dir, name);
+
+    int result = writer_save(w, path);
+    if(result == 0)
+        printf("%s %lu bytes\n", path, (unsigned long)w->len);
+
+    writer_free(w);
+    return result;
+}
+
+int main
+    (int argc, char** argv)
+{
+    struct gen_config cfg = {
+        ".", "main",
+        1000, 100, 1000, 100, 1000, 32, 0
+    };
+
+    int opt;
+    while((opt = getopt(argc, argv, "o:n:s:t:g:c:f:b:l:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o': cfg.dir = optarg; break;
+            case 'n': cfg.name = optarg; break;
+            case 's': cfg.strings = atol(optarg); break;
+            case 't': cfg.structs = atol(optarg); break;
+            case 'g': cfg.globals = atol(optarg); break;
+            case 'c': cfg.natives = atol(optarg); break;
+            case 'f': cfg.funcs = atol(optarg); break;
+            case 'b': cfg.body = atol(optarg); break;
+            case 'l': cfg.libs = atol(optarg); break;
+            default:
+            fprintf(stderr, "usage: %s [-o dir] [-n name] [-s strings] [-t structs] [-g globals] "
+                "[-c natives] [-f functions] [-b body ops] [-l libraries]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int l;
+    for(l = 0; l < clamp(cfg.libs); ++l)
+    {
+        char lib_name[32];
+        snprintf(lib_name, sizeof(lib_name), "lib_%d", l);
+
+        if(write_module(&cfg, lib_name, 1) != 0)
+        {
+            fprintf(stderr, "gen error! unable to write %s.\n", lib_name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(write_module(&cfg, cfg.name, 0) != 0)
+    {
+        fprintf(stderr, "gen error! unable to write %s.\n", cfg.name);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
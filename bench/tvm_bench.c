@@ -0,0 +1,760 @@
+/*
+ * tvm_bench.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+/*
+Benchmark of the VM on a fixed corpus of generated programs.
+Each program reads the iterations number from argv[1] and returns a checksum,
+it is run by tvm with n and 2n iterations so the difference is the steady state
+run time without load and compile. Load, parse and compile times come from
+TRIPEL_STATS, compilation is eager. Every program has a C baseline that computes
+the same checksum.
+
+usage: tvm-bench [tvm path] [corpus directory] [iterations scale]
+*/
+
+#include "tvm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#ifndef TVM_PATH
+#define TVM_PATH "./tvm"
+#endif
+
+#define REPEATS 3
+
+#define LOCAL_N     0
+#define LOCAL_I     1
+#define LOCAL_ACC   2
+#define LOCAL_TMP   3
+
+#define LABEL_LOOP  0
+#define LABEL_END   1
+
+/*Index of the natives imported by the start module*/
+#define NATIVE_ATOI 0
+#define NATIVE_ABS  1
+
+static double now_ns
+    (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**** corpus ****/
+
+/*Parts of a module that change between the programs of the corpus*/
+struct bench_module
+{
+    uint16_t structs_num;
+    writer_t structs;
+    int natives;
+    writer_t start;
+    uint16_t start_locals;
+    uint16_t funcs_num;
+    writer_t funcs;
+    uint16_t ext_funcs_num;
+    writer_t imports;
+};
+
+static void bench_module_init
+    (struct bench_module* m)
+{
+    memset(m, 0, sizeof(struct bench_module));
+    m->structs = writer_create();
+    m->start = writer_create();
+    m->funcs = writer_create();
+    m->imports = writer_create();
+}
+
+static int bench_module_save
+    (struct bench_module* m, const char* path)
+{
+    writer_t w = writer_create();
+    writer_header(w);
+
+    //strings
+    writer_u16(w, 0);
+
+    writer_u16(w, m->structs_num);
+    writer_append(w, m->structs);
+
+    //globals
+    writer_u16(w, 0);
+
+    if(m->natives)
+    {
+        writer_u16(w, 2);
+        writer_u16(w, 1);
+        writer_name(w, "libc.so.6");
+        writer_u16(w, 2);
+
+        writer_name(w, "atoi");
+        writer_u8(w, TYPEID_INT);
+        writer_u16(w, 1);
+        writer_u8(w, TYPEID_POINTER);
+        writer_u8(w, TYPEID_SBYTE);
+        writer_u8(w, TVM_NATIVE_NOTHROW | TVM_NATIVE_PURE | TVM_NATIVE_LEAF);
+
+        writer_name(w, "abs");
+        writer_u8(w, TYPEID_INT);
+        writer_u16(w, 1);
+        writer_u8(w, TYPEID_INT);
+        writer_u8(w, TVM_NATIVE_NOTHROW | TVM_NATIVE_PURE | TVM_NATIVE_LEAF);
+    }
+    else
+    {
+        writer_u16(w, 0);
+        writer_u16(w, 0);
+    }
+
+    writer_body(w, 16, m->start_locals, 2, m->start);
+
+    writer_u16(w, m->funcs_num);
+    writer_append(w, m->funcs);
+
+    //external structs, globals, natives and functions
+    writer_u16(w, 0);
+    writer_u16(w, 0);
+    writer_u16(w, 0);
+    writer_u16(w, m->ext_funcs_num);
+
+    if(m->imports->len == 0)
+        writer_u16(w, 0);
+    else
+        writer_append(w, m->imports);
+
+    int result = writer_save(w, path);
+
+    writer_free(w);
+    writer_free(m->structs);
+    writer_free(m->start);
+    writer_free(m->funcs);
+    writer_free(m->imports);
+    return result;
+}
+
+/*n = atoi(argv[1]), i = 0*/
+static void emit_prologue
+    (writer_t code)
+{
+    writer_op_u16(code, OP_DECL_I32, LOCAL_N);
+    writer_u8(code, OP_PUSH_ARG_1);
+    writer_u8(code, OP_CAST_PT);
+    writer_u8(code, TYPEID_POINTER);
+    writer_u8(code, TYPEID_SBYTE);
+    writer_u8(code, OP_AT_1);
+    writer_op_u16(code, OP_N_CALL, NATIVE_ATOI);
+    writer_u8(code, OP_STORE_0);
+
+    writer_op_u16(code, OP_DECL_I32, LOCAL_I);
+    writer_op_i32(code, OP_LD_I32, 0);
+    writer_u8(code, OP_STORE_1);
+}
+
+/*acc = 0*/
+static void emit_acc
+    (writer_t code)
+{
+    writer_op_u16(code, OP_DECL_I32, LOCAL_ACC);
+    writer_op_i32(code, OP_LD_I32, 0);
+    writer_u8(code, OP_STORE_2);
+}
+
+/*while(i < n) {*/
+static void emit_loop_head
+    (writer_t code)
+{
+    writer_op_u16(code, OP_LABEL, LABEL_LOOP);
+    writer_u8(code, OP_PUSH_1);
+    writer_u8(code, OP_PUSH_0);
+    writer_u8(code, OP_LT);
+    writer_op_u16(code, OP_JMP_IF_N, LABEL_END);
+}
+
+/*++i; }*/
+static void emit_loop_tail
+    (writer_t code)
+{
+    writer_u8(code, OP_PUSH_1);
+    writer_u8(code, OP_INC);
+    writer_u8(code, OP_STORE_1);
+    writer_op_u16(code, OP_JMP, LABEL_LOOP);
+    writer_op_u16(code, OP_LABEL, LABEL_END);
+}
+
+/*return acc*/
+static void emit_return_acc
+    (writer_t code)
+{
+    writer_u8(code, OP_PUSH_2);
+    writer_u8(code, OP_RET);
+}
+
+/*acc = acc * 31 + (i ^ (i >> 3))*/
+static int write_arith
+    (const char* dir)
+{
+    struct bench_module m;
+    bench_module_init(&m);
+    m.natives = 1;
+    m.start_locals = 3;
+
+    emit_prologue(m.start);
+    emit_acc(m.start);
+    emit_loop_head(m.start);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_op_i32(m.start, OP_LD_I32, 31);
+    writer_u8(m.start, OP_MUL);
+    writer_u8(m.start, OP_PUSH_1);
+    writer_u8(m.start, OP_PUSH_1);
+    writer_op_i32(m.start, OP_LD_I32, 3);
+    writer_u8(m.start, OP_SHR);
+    writer_u8(m.start, OP_XOR);
+    writer_u8(m.start, OP_ADD);
+    writer_u8(m.start, OP_STORE_2);
+    emit_loop_tail(m.start);
+    emit_return_acc(m.start);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/arith.tripel", dir);
+    return bench_module_save(&m, path);
+}
+
+static jit_uint c_arith
+    (int n)
+{
+    jit_uint acc = 0;
+    int i;
+    for(i = 0; i < n; ++i)
+        acc = acc * 31 + (jit_uint)(i ^ (i >> 3));
+    return acc;
+}
+
+/*v.x += i, v.y ^= v.x through a pointer, return v.x + v.y*/
+static int write_struct
+    (const char* dir)
+{
+    struct bench_module m;
+    bench_module_init(&m);
+    m.natives = 1;
+    m.start_locals = 3;
+
+    m.structs_num = 1;
+    writer_name(m.structs, "vec");
+    writer_u16(m.structs, 2);
+    writer_name(m.structs, "x");
+    writer_u8(m.structs, TYPEID_INT);
+    writer_name(m.structs, "y");
+    writer_u8(m.structs, TYPEID_INT);
+
+    emit_prologue(m.start);
+
+    //the struct takes the place of acc
+    writer_op_u16(m.start, OP_DECL_ST, LOCAL_ACC);
+    writer_u16(m.start, 0);
+    writer_op_i32(m.start, OP_LD_I32, 0);
+    writer_op_u16(m.start, OP_SET_FIELD_0, LOCAL_ACC);
+    writer_op_i32(m.start, OP_LD_I32, 0);
+    writer_op_u16(m.start, OP_SET_FIELD_1, LOCAL_ACC);
+
+    emit_loop_head(m.start);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_FIELD_0);
+    writer_u8(m.start, OP_PUSH_1);
+    writer_u8(m.start, OP_ADD);
+    writer_op_u16(m.start, OP_SET_FIELD_0, LOCAL_ACC);
+    writer_u8(m.start, OP_PUSH_AD_2);
+    writer_u8(m.start, OP_PT_FIELD_1);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_FIELD_0);
+    writer_u8(m.start, OP_XOR);
+    writer_op_u16(m.start, OP_SET_FIELD_1, LOCAL_ACC);
+    emit_loop_tail(m.start);
+
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_FIELD_0);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_FIELD_1);
+    writer_u8(m.start, OP_ADD);
+    writer_u8(m.start, OP_RET);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/struct.tripel", dir);
+    return bench_module_save(&m, path);
+}
+
+struct vec
+{
+    jit_uint x;
+    jit_uint y;
+};
+
+static jit_uint c_struct
+    (int n)
+{
+    struct vec v = { 0, 0 };
+    struct vec* volatile pv = &v;
+    int i;
+    for(i = 0; i < n; ++i)
+    {
+        v.x += i;
+        pv->y ^= v.x;
+    }
+    return v.x + v.y;
+}
+
+/*acc += abs(i - n / 2)*/
+static int write_native
+    (const char* dir)
+{
+    struct bench_module m;
+    bench_module_init(&m);
+    m.natives = 1;
+    m.start_locals = 3;
+
+    emit_prologue(m.start);
+    emit_acc(m.start);
+    emit_loop_head(m.start);
+    writer_u8(m.start, OP_PUSH_1);
+    writer_u8(m.start, OP_PUSH_0);
+    writer_op_i32(m.start, OP_LD_I32, 2);
+    writer_u8(m.start, OP_DIV);
+    writer_u8(m.start, OP_SUB);
+    writer_op_u16(m.start, OP_N_CALL, NATIVE_ABS);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_ADD);
+    writer_u8(m.start, OP_STORE_2);
+    emit_loop_tail(m.start);
+    emit_return_acc(m.start);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/native.tripel", dir);
+    return bench_module_save(&m, path);
+}
+
+static jit_uint c_native
+    (int n)
+{
+    //called through a pointer like the VM does
+    int (*volatile abs_ptr)(int) = &abs;
+    jit_uint acc = 0;
+    int i;
+    for(i = 0; i < n; ++i)
+        acc += abs_ptr(i - n / 2);
+    return acc;
+}
+
+/*p = GC_malloc(64), *p = i, acc += *p*/
+static int write_gc
+    (const char* dir)
+{
+    struct bench_module m;
+    bench_module_init(&m);
+    m.natives = 1;
+    m.start_locals = 4;
+
+    emit_prologue(m.start);
+    emit_acc(m.start);
+    writer_op_u16(m.start, OP_DECL_PT, LOCAL_TMP);
+    writer_u8(m.start, TYPEID_INT);
+
+    emit_loop_head(m.start);
+    writer_op_i32(m.start, OP_GC_ALLOC_C, 64);
+    writer_u8(m.start, OP_CAST_PT);
+    writer_u8(m.start, TYPEID_INT);
+    writer_u8(m.start, OP_STORE_3);
+    writer_u8(m.start, OP_PUSH_3);
+    writer_u8(m.start, OP_PUSH_1);
+    writer_u8(m.start, OP_VAL_ASSIGN);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_PUSH_3);
+    writer_u8(m.start, OP_VAL);
+    writer_u8(m.start, OP_ADD);
+    writer_u8(m.start, OP_STORE_2);
+    emit_loop_tail(m.start);
+    emit_return_acc(m.start);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/gc.tripel", dir);
+    return bench_module_save(&m, path);
+}
+
+static jit_uint c_gc
+    (int n)
+{
+    jit_uint acc = 0;
+    int i;
+    for(i = 0; i < n; ++i)
+    {
+        int* p = GC_MALLOC(64);
+        *p = i;
+        acc += *p;
+    }
+    return acc;
+}
+
+/*acc = mix(acc, i) where mix is imported from benchlib*/
+static int write_multi
+    (const char* dir)
+{
+    char path[4096];
+
+    //library with mix(a, b) = a * 31 + b
+    struct bench_module lib;
+    bench_module_init(&lib);
+
+    writer_op_i32(lib.start, OP_LD_I32, 0);
+    writer_u8(lib.start, OP_RET);
+
+    lib.funcs_num = 1;
+    writer_name(lib.funcs, "mix");
+    writer_u8(lib.funcs, TYPEID_INT);
+    writer_u16(lib.funcs, 2);
+    writer_u8(lib.funcs, TYPEID_INT);
+    writer_u8(lib.funcs, TYPEID_INT);
+
+    writer_t code = writer_create();
+    writer_u8(code, OP_PUSH_ARG_0);
+    writer_op_i32(code, OP_LD_I32, 31);
+    writer_u8(code, OP_MUL);
+    writer_u8(code, OP_PUSH_ARG_1);
+    writer_u8(code, OP_ADD);
+    writer_u8(code, OP_RET);
+    writer_body(lib.funcs, 4, 0, 0, code);
+    writer_free(code);
+
+    snprintf(path, sizeof(path), "%s/benchlib.tripel", dir);
+    if(bench_module_save(&lib, path) != 0)
+        return -1;
+
+    struct bench_module m;
+    bench_module_init(&m);
+    m.natives = 1;
+    m.start_locals = 3;
+
+    emit_prologue(m.start);
+    emit_acc(m.start);
+    emit_loop_head(m.start);
+    writer_u8(m.start, OP_PUSH_2);
+    writer_u8(m.start, OP_PUSH_1);
+    writer_op_u16(m.start, OP_E_CALL, 0);
+    writer_u8(m.start, OP_STORE_2);
+    emit_loop_tail(m.start);
+    emit_return_acc(m.start);
+
+    m.ext_funcs_num = 1;
+    writer_u16(m.imports, 1);
+    writer_name(m.imports, "benchlib");
+    writer_u16(m.imports, 0);
+    writer_u16(m.imports, 0);
+    writer_u16(m.imports, 0);
+    writer_u16(m.imports, 1);
+    writer_name(m.imports, "mix");
+
+    snprintf(path, sizeof(path), "%s/multi.tripel", dir);
+    return bench_module_save(&m, path);
+}
+
+__attribute__((noinline)) static jit_uint c_mix
+    (jit_uint a, jit_uint b)
+{
+    return a * 31 + b;
+}
+
+static jit_uint c_multi
+    (int n)
+{
+    jit_uint acc = 0;
+    int i;
+    for(i = 0; i < n; ++i)
+        acc = c_mix(acc, i);
+    return acc;
+}
+
+/*
+count(i, n, acc) returns acc when i >= n, else count(i + 1, n, acc * 31 + i).
+The recursion is as deep as n, it needs tail calls to run in constant stack.
+*/
+static int write_tail
+    (const char* dir)
+{
+    struct bench_module m;
+    bench_module_init(&m);
+    m.natives = 1;
+    m.start_locals = 2;
+
+    m.funcs_num = 1;
+    writer_name(m.funcs, "count");
+    writer_u8(m.funcs, TYPEID_INT);
+    writer_u16(m.funcs, 3);
+    writer_u8(m.funcs, TYPEID_INT);
+    writer_u8(m.funcs, TYPEID_INT);
+    writer_u8(m.funcs, TYPEID_INT);
+
+    writer_t code = writer_create();
+    writer_u8(code, OP_PUSH_ARG_0);
+    writer_u8(code, OP_PUSH_ARG_1);
+    writer_u8(code, OP_LT);
+    writer_op_u16(code, OP_JMP_IF, 0);
+    writer_u8(code, OP_PUSH_ARG_2);
+    writer_u8(code, OP_RET);
+    writer_op_u16(code, OP_LABEL, 0);
+    writer_u8(code, OP_PUSH_ARG_0);
+    writer_op_i32(code, OP_LD_I32, 1);
+    writer_u8(code, OP_ADD);
+    writer_u8(code, OP_PUSH_ARG_1);
+    writer_u8(code, OP_PUSH_ARG_2);
+    writer_op_i32(code, OP_LD_I32, 31);
+    writer_u8(code, OP_MUL);
+    writer_u8(code, OP_PUSH_ARG_0);
+    writer_u8(code, OP_ADD);
+    writer_op_u16(code, OP_CALL, 0);
+    writer_u8(code, OP_RET);
+    writer_body(m.funcs, 8, 0, 1, code);
+    writer_free(code);
+
+    emit_prologue(m.start);
+    writer_op_i32(m.start, OP_LD_I32, 0);
+    writer_u8(m.start, OP_PUSH_0);
+    writer_op_i32(m.start, OP_LD_I32, 0);
+    writer_op_u16(m.start, OP_CALL, 0);
+    writer_u8(m.start, OP_RET);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tail.tripel", dir);
+    return bench_module_save(&m, path);
+}
+
+static jit_uint c_tail
+    (int n)
+{
+    jit_uint acc = 0;
+    int i;
+    for(i = 0; i < n; ++i)
+        acc = acc * 31 + i;
+    return acc;
+}
+
+struct bench_program
+{
+    const char* name;
+    int (*write)(const char*);
+    jit_uint (*baseline)(int);
+    int iterations;
+};
+
+static struct bench_program programs[] = {
+    { "arith", &write_arith, &c_arith, 50000000 },
+    { "struct", &write_struct, &c_struct, 50000000 },
+    { "native", &write_native, &c_native, 20000000 },
+    { "gc", &write_gc, &c_gc, 2000000 },
+    { "multi", &write_multi, &c_multi, 20000000 },
+    { "tail", &write_tail, &c_tail, 20000000 }
+};
+
+/**** runner ****/
+
+struct bench_run
+{
+    double wall_ns;
+    long max_rss_kb;
+    int status;
+};
+
+static int run_tvm
+    (const char* tvm, const char* dir, const char* name, int n, const char* stats, struct bench_run* run)
+{
+    char file[256];
+    char arg[32];
+    snprintf(file, sizeof(file), "%s.tripel", name);
+    snprintf(arg, sizeof(arg), "%d", n);
+
+    double begin = now_ns();
+
+    pid_t pid = fork();
+    if(pid < 0)
+        return -1;
+
+    if(pid == 0)
+    {
+        //libraries are searched in the working directory
+        if(chdir(dir) != 0)
+            _exit(127);
+
+        setenv("TRIPEL_EAGER", "1", 1);
+        if(stats)
+            setenv("TRIPEL_STATS", stats, 1);
+        else
+            unsetenv("TRIPEL_STATS");
+
+        execl(tvm, tvm, file, arg, (char*)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0)
+        return -1;
+
+    run->wall_ns = now_ns() - begin;
+    run->max_rss_kb = usage.ru_maxrss;
+    run->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    return 0;
+}
+
+/*Sum all the numbers following key in a stats file*/
+static double stats_sum
+    (const char* path, const char* key)
+{
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL)
+        return 0;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    char* text = malloc(size + 1);
+    text[fread(text, 1, size, fp)] = 0;
+    fclose(fp);
+
+    size_t key_len = strlen(key);
+    double sum = 0;
+    char* it = text;
+    while((it = strstr(it, key)) != NULL)
+    {
+        it += key_len;
+        sum += strtod(it, &it);
+    }
+
+    free(text);
+    return sum;
+}
+
+int main
+    (int argc, char** argv)
+{
+    GC_INIT();
+
+    const char* tvm = argc > 1 ? argv[1] : TVM_PATH;
+    const char* dir = argc > 2 ? argv[2] : "tvm-bench-corpus";
+    double scale = argc > 3 ? atof(argv[3]) : 1.0;
+
+    //the runner changes directory so tvm must be absolute
+    char tvm_abs[4096];
+    if(realpath(tvm, tvm_abs) == NULL)
+    {
+        fprintf(stderr, "bench error! tvm not found at %s.\n", tvm);
+        return EXIT_FAILURE;
+    }
+
+    mkdir(dir, 0755);
+
+    char stats[4096];
+    char dir_abs[4096];
+    if(realpath(dir, dir_abs) == NULL)
+    {
+        fprintf(stderr, "bench error! unable to create %s.\n", dir);
+        return EXIT_FAILURE;
+    }
+    snprintf(stats, sizeof(stats), "%s/stats.json", dir_abs);
+
+    printf("%-8s %12s %10s %10s %12s %12s %8s %10s %6s\n",
+        "program", "iterations", "load ms", "compile ms", "run ms", "C ms", "ratio", "rss KB", "check");
+
+    int failed = 0;
+    size_t p;
+    for(p = 0; p < sizeof(programs) / sizeof(programs[0]); ++p)
+    {
+        struct bench_program* prog = programs + p;
+        int n = (int)(prog->iterations * scale);
+        if(n < 1)
+            n = 1;
+
+        if(prog->write(dir_abs) != 0)
+        {
+            fprintf(stderr, "bench error! unable to write %s.\n", prog->name);
+            return EXIT_FAILURE;
+        }
+
+        //best of REPEATS for both the VM and the baseline
+        double run_ns = 0, c_ns = 0, load_ns = 0, compile_ns = 0;
+        long rss = 0;
+        int status = -1;
+        jit_uint checksum = 0;
+
+        int r;
+        for(r = 0; r < REPEATS; ++r)
+        {
+            struct bench_run short_run, long_run;
+            if(run_tvm(tvm_abs, dir_abs, prog->name, n, stats, &short_run) != 0 ||
+               run_tvm(tvm_abs, dir_abs, prog->name, 2 * n, NULL, &long_run) != 0)
+            {
+                fprintf(stderr, "bench error! unable to run %s.\n", tvm_abs);
+                return EXIT_FAILURE;
+            }
+
+            double steady = long_run.wall_ns - short_run.wall_ns;
+            if(r == 0 || steady < run_ns)
+                run_ns = steady;
+
+            double load = stats_sum(stats, "\"load_ns\": ") + stats_sum(stats, "\"parse_ns\": ");
+            double compile = stats_sum(stats, "\"compile_ns\": ");
+            if(r == 0 || load < load_ns)
+                load_ns = load;
+            if(r == 0 || compile < compile_ns)
+                compile_ns = compile;
+
+            if(long_run.max_rss_kb > rss)
+                rss = long_run.max_rss_kb;
+            status = short_run.status;
+
+            double begin = now_ns();
+            checksum = prog->baseline(n);
+            double c = now_ns() - begin;
+            if(r == 0 || c < c_ns)
+                c_ns = c;
+        }
+
+        //exit codes keep only the low byte of the checksum
+        int ok = status == (int)(checksum & 0xff);
+        failed |= !ok;
+
+        printf("%-8s %12d %10.3f %10.3f %12.3f %12.3f %8.2f %10ld %6s\n",
+            prog->name, n, load_ns / 1e6, compile_ns / 1e6, run_ns / 1e6, c_ns / 1e6,
+            c_ns > 0 ? run_ns / c_ns : 0, rss, ok ? "ok" : "FAIL");
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/*
+ * writer.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+writer_t writer_create
+    (void)
+{
+    writer_t w = malloc(sizeof(struct _writer));
+    w->allocd = 256;
+    w->data = malloc(w->allocd);
+    w->len = 0;
+    return w;
+}
+
+void writer_free
+    (writer_t w)
+{
+    free(w->data);
+    free(w);
+}
+
+static void writer_bytes
+    (writer_t w, const void* bytes, size_t len)
+{
+    if(w->len + len > w->allocd)
+    {
+        while(w->len + len > w->allocd)
+            w->allocd *= 2;
+        w->data = realloc(w->data, w->allocd);
+    }
+
+    memcpy(w->data + w->len, bytes, len);
+    w->len += len;
+}
+
+void writer_u8
+    (writer_t w, uint8_t v)
+{
+    writer_bytes(w, &v, 1);
+}
+
+void writer_u16
+    (writer_t w, uint16_t v)
+{
+    writer_u8(w, v & 0xff);
+    writer_u8(w, v >> 8);
+}
+
+void writer_u32
+    (writer_t w, uint32_t v)
+{
+    writer_u16(w, v & 0xffff);
+    writer_u16(w, v >> 16);
+}
+
+void writer_u64
+    (writer_t w, uint64_t v)
+{
+    writer_u32(w, v & 0xffffffff);
+    writer_u32(w, v >> 32);
+}
+
+void writer_name
+    (writer_t w, const char* name)
+{
+    writer_bytes(w, name, strlen(name) + 1);
+}
+
+void writer_header
+    (writer_t w)
+{
+    writer_name(w, TVM_MODULE_MAGIC);
+    writer_u8(w, TVM_MODULE_VERSION);
+}
+
+void writer_append
+    (writer_t w, writer_t other)
+{
+    writer_bytes(w, other->data, other->len);
+}
+
+void writer_op_u16
+    (writer_t w, uint8_t op, uint16_t v)
+{
+    writer_u8(w, op);
+    writer_u16(w, v);
+}
+
+void writer_op_i32
+    (writer_t w, uint8_t op, int32_t v)
+{
+    writer_u8(w, op);
+    writer_u32(w, (uint32_t)v);
+}
+
+void writer_body
+    (writer_t w, uint16_t stack_len, uint16_t locals_num, uint16_t labels_num, writer_t code)
+{
+    writer_u16(w, stack_len);
+    writer_u16(w, locals_num);
+    writer_u16(w, labels_num);
+    writer_u32(w, code->len);
+    writer_append(w, code);
+}
+
+int writer_save
+    (writer_t w, const char* path)
+{
+    FILE* fp = fopen(path, "wb");
+    if(fp == NULL)
+        return -1;
+
+    size_t written = fwrite(w->data, 1, w->len, fp);
+
+    if(fclose(fp) != 0 || written != w->len)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * writer.h
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#ifndef __TRIPEL__WRITER__H
+#define __TRIPEL__WRITER__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Growable buffer used to emit .tripel files, values are written little endian.
+Sections must be written in the order read by tvm_module_parse.
+*/
+struct _writer
+{
+    unsigned char* data;
+    size_t len;
+    size_t allocd;
+};
+
+typedef struct _writer* writer_t;
+
+writer_t writer_create
+    (void);
+
+void writer_free
+    (writer_t w);
+
+void writer_u8
+    (writer_t w, uint8_t v);
+
+void writer_u16
+    (writer_t w, uint16_t v);
+
+void writer_u32
+    (writer_t w, uint32_t v);
+
+void writer_u64
+    (writer_t w, uint64_t v);
+
+/*Write the module magic and format version, must be the first thing written*/
+void writer_header
+    (writer_t w);
+
+/*Write a NUL terminated name*/
+void writer_name
+    (writer_t w, const char* name);
+
+/*Append the content of another buffer*/
+void writer_append
+    (writer_t w, writer_t other);
+
+/*Write an opcode with an ushort operand*/
+void writer_op_u16
+    (writer_t w, uint8_t op, uint16_t v);
+
+/*Write an opcode with an int operand*/
+void writer_op_i32
+    (writer_t w, uint8_t op, int32_t v);
+
+/*Write the properties, the length and the code of a function body*/
+void writer_body
+    (writer_t w, uint16_t stack_len, uint16_t locals_num, uint16_t labels_num, writer_t code);
+
+/*Write the buffer to a file, -1 on error*/
+int writer_save
+    (writer_t w, const char* path);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * collector.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+
+static tvm_gc_stats_t tvm_gc_stats;
+
+static jit_ulong tvm_gc_pause_begin;
+
+/*Called by the collector with the allocation lock held, so the counters need no lock*/
+static void GC_CALLBACK tvm_gc_on_event
+    (GC_EventType event)
+{
+    switch(event)
+    {
+        case GC_EVENT_PRE_STOP_WORLD:
+        tvm_gc_pause_begin = tvm_clock_ns();
+        break;
+
+        case GC_EVENT_POST_START_WORLD:
+        {
+            jit_ulong pause = tvm_clock_ns() - tvm_gc_pause_begin;
+            tvm_gc_stats.pauses++;
+            tvm_gc_stats.pause_total_ns += pause;
+            if(pause > tvm_gc_stats.pause_max_ns)
+                tvm_gc_stats.pause_max_ns = pause;
+            break;
+        }
+
+        case GC_EVENT_END:
+        tvm_gc_stats.collections++;
+        tvm_gc_stats.heap_size = GC_get_heap_size();
+        if(tvm_gc_stats.heap_size > tvm_gc_stats.heap_max_size)
+            tvm_gc_stats.heap_max_size = tvm_gc_stats.heap_size;
+        break;
+
+        default:
+        break;
+    }
+}
+
+void tvm_gc_setup
+    (void)
+{
+    if(tvm_gc_divisor != 0)
+        GC_set_free_space_divisor(tvm_gc_divisor);
+
+    //the heap grows from its current size, usually a few pages after GC_INIT
+    size_t heap_size = GC_get_heap_size();
+    if(tvm_gc_initial_heap > heap_size)
+        GC_expand_hp(tvm_gc_initial_heap - heap_size);
+
+    if(tvm_gc_incremental)
+    {
+        //with parallel markers the collector is only generational, the time limit has no effect
+        if(tvm_gc_pause_ms != 0)
+            GC_set_time_limit(tvm_gc_pause_ms);
+        GC_enable_incremental();
+    }
+
+    tvm_gc_stats.heap_size = GC_get_heap_size();
+    tvm_gc_stats.heap_max_size = tvm_gc_stats.heap_size;
+    GC_set_on_collection_event(&tvm_gc_on_event);
+}
+
+static void* GC_CALLBACK tvm_gc_copy_stats
+    (void* stats)
+{
+    *(tvm_gc_stats_t*)stats = tvm_gc_stats;
+    return NULL;
+}
+
+void tvm_gc_get_stats
+    (tvm_gc_stats_t* stats)
+{
+    //copied under the allocation lock to not read a collection half done
+    GC_call_with_alloc_lock(&tvm_gc_copy_stats, stats);
+}
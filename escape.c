@@ -0,0 +1,319 @@
+/*
+ * escape.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+
+/*Allocations bigger than this stay on the GC heap*/
+#define TVM_STACK_ALLOC_MAX 256
+
+/*Allocation sites are the bits of a jit_ulong*/
+#define TVM_ESCAPE_MAX_SITES 64
+
+/*
+State of the analysis. Stack slots and locals hold the set of allocation sites
+whose pointers they may contain, locals are not flow sensitive.
+*/
+struct _tvm_escape
+{
+    jit_ulong* stack;
+    int depth;
+
+    jit_ulong* locals;
+    char* addressed;//locals whose address is taken, what they hold escapes
+
+    jit_ulong escaped;
+};
+
+typedef struct _tvm_escape* tvm_escape_t;
+
+static void tvm_escape_push
+    (tvm_escape_t e, jit_ulong sites)
+{
+    e->stack[e->depth++] = sites;
+}
+
+/*Pop n values, they escape unless the instruction only reads them*/
+static void tvm_escape_pop_n
+    (tvm_escape_t e, int n, int escapes)
+{
+    while(n--)
+    {
+        --e->depth;
+        if(escapes)
+            e->escaped |= e->stack[e->depth];
+    }
+}
+
+/*The stack is not merged at labels and jumps, what is on it escapes*/
+static void tvm_escape_stack
+    (tvm_escape_t e)
+{
+    int i;
+    for(i = 0; i < e->depth; ++i)
+        e->escaped |= e->stack[i];
+}
+
+/*Mark the instructions between a label and a jump back to it*/
+static char* tvm_escape_loops
+    (tvm_func_data_t data)
+{
+    int len = data->insns_end - data->insns;
+    char* in_loop = jit_calloc(len + 1, sizeof(char));
+    int* labels_pos = jit_malloc((data->labels_num + 1) * sizeof(int));
+
+    int i;
+    for(i = 0; i < data->labels_num; ++i)
+        labels_pos[i] = -1;
+
+    for(i = 0; i < len; ++i)
+    {
+        tvm_insn_t* insn = data->insns + i;
+
+        if(insn->opcode == OP_LABEL)
+            labels_pos[insn->index] = i;
+        else if(insn->opcode == OP_JMP || insn->opcode == OP_JMP_IF || insn->opcode == OP_JMP_IF_N)
+        {
+            int pos = labels_pos[insn->index];
+            if(pos >= 0)
+                jit_memset(in_loop + pos, 1, i - pos + 1);
+        }
+    }
+
+    jit_free(labels_pos);
+    return in_loop;
+}
+
+/*One pass over the body, 0 if the stack effects are not consistent*/
+static int tvm_escape_pass
+    (tvm_escape_t e, tvm_func_data_t data, jit_ulong* sites)
+{
+    e->depth = 0;
+
+    tvm_insn_t* insn;
+    for(insn = data->insns; insn < data->insns_end; ++insn)
+    {
+        int pops = insn->pops;
+        if(insn->opcode == OP_CALL_PT)
+            pops = jit_type_num_params(insn->type) + 1;
+
+        if(pops > e->depth && insn->opcode != OP_CLEAR)
+            return 0;
+
+        switch(insn->opcode)
+        {
+            case OP_GC_ALLOC_C:
+            case OP_GC_ATOM_ALLOC_C:
+            tvm_escape_push(e, sites[insn - data->insns]);
+            break;
+
+            case OP_PUSH:
+            case OP_PUSH_0:
+            case OP_PUSH_1:
+            case OP_PUSH_2:
+            case OP_PUSH_3:
+            tvm_escape_push(e, e->locals[insn->index]);
+            break;
+
+            case OP_STORE:
+            case OP_STORE_0:
+            case OP_STORE_1:
+            case OP_STORE_2:
+            case OP_STORE_3:
+            {
+                jit_ulong value = e->stack[--e->depth];
+                e->locals[insn->index] |= value;
+                if(e->addressed[insn->index])
+                    e->escaped |= value;
+                break;
+            }
+
+            case OP_PUSH_AD:
+            case OP_PUSH_AD_0:
+            case OP_PUSH_AD_1:
+            case OP_PUSH_AD_2:
+            case OP_PUSH_AD_3:
+            e->addressed[insn->index] = 1;
+            e->escaped |= e->locals[insn->index];
+            tvm_escape_push(e, 0);
+            break;
+
+            case OP_DUP:
+            tvm_escape_push(e, e->stack[e->depth - 1]);
+            break;
+
+            case OP_CLEAR:
+            tvm_escape_stack(e);
+            e->depth = 0;
+            break;
+
+            case OP_CAST_PT:
+            case OP_CAST_VP:
+            break;
+
+            //the pointer under the other operands is only dereferenced
+            case OP_VAL:
+            case OP_AT:
+            case OP_AT_C:
+            case OP_AT_1:
+            case OP_AT_2:
+            case OP_AT_3:
+            case OP_AD_AT:
+            case OP_AD_AT_C:
+            case OP_AD_AT_1:
+            case OP_AD_AT_2:
+            case OP_AD_AT_3:
+            case OP_PT_FIELD:
+            case OP_PT_FIELD_0:
+            case OP_PT_FIELD_1:
+            case OP_PT_FIELD_2:
+            case OP_PT_FIELD_3:
+            case OP_AD_PT_FIELD:
+            case OP_AD_PT_FIELD_0:
+            case OP_AD_PT_FIELD_1:
+            case OP_AD_PT_FIELD_2:
+            case OP_AD_PT_FIELD_3:
+            case OP_SET_AT:
+            case OP_SET_AT_0:
+            case OP_SET_AT_1:
+            case OP_SET_AT_2:
+            case OP_SET_AT_3:
+            case OP_SET_AT_C:
+            case OP_SET_PT_FIELD:
+            case OP_SET_PT_FIELD_0:
+            case OP_SET_PT_FIELD_1:
+            case OP_SET_PT_FIELD_2:
+            case OP_SET_PT_FIELD_3:
+            case OP_VAL_ASSIGN:
+            {
+                jit_ulong base = e->stack[e->depth - pops];
+                tvm_escape_pop_n(e, pops - 1, 1);
+                --e->depth;
+
+                //addresses inside the object are the object
+                int derived = (insn->opcode >= OP_AD_AT && insn->opcode <= OP_AD_AT_3) ||
+                              (insn->opcode >= OP_AD_PT_FIELD && insn->opcode <= OP_AD_PT_FIELD_3);
+                if(insn->pushes)
+                    tvm_escape_push(e, derived ? base : 0);
+                break;
+            }
+
+            case OP_POP:
+            case OP_IS_NULL:
+            case OP_TO_BOOL:
+            case OP_TO_BOOL_N:
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+            tvm_escape_pop_n(e, pops, 0);
+            if(insn->pushes)
+                tvm_escape_push(e, 0);
+            break;
+
+            case OP_JMP_IF:
+            case OP_JMP_IF_N:
+            tvm_escape_pop_n(e, pops, 0);
+            tvm_escape_stack(e);
+            break;
+
+            case OP_JMP:
+            case OP_LABEL:
+            tvm_escape_stack(e);
+            break;
+
+            //stored, returned, passed to a call or unknown
+            default:
+            {
+                tvm_escape_pop_n(e, pops, 1);
+                int i;
+                for(i = 0; i < insn->pushes; ++i)
+                    tvm_escape_push(e, 0);
+            }
+        }
+    }
+
+    return 1;
+}
+
+void tvm_function_escape_analysis
+    (jit_function_t function)
+{
+    tvm_func_data_t data = tvm_function_get_data(function);
+    int len = data->insns_end - data->insns;
+
+    //candidates are constant size allocations executed once per call
+    char* in_loop = tvm_escape_loops(data);
+    jit_ulong* sites = jit_calloc(len + 1, sizeof(jit_ulong));
+    int sites_num = 0;
+
+    int i;
+    for(i = 0; i < len && sites_num < TVM_ESCAPE_MAX_SITES; ++i)
+    {
+        tvm_insn_t* insn = data->insns + i;
+        if((insn->opcode == OP_GC_ALLOC_C || insn->opcode == OP_GC_ATOM_ALLOC_C) &&
+           insn->imm.nint <= TVM_STACK_ALLOC_MAX && !in_loop[i])
+            sites[i] = (jit_ulong)1 << sites_num++;
+    }
+
+    if(sites_num != 0)
+    {
+        struct _tvm_escape e;
+        e.stack = jit_malloc((data->max_stack + 1) * sizeof(jit_ulong));
+        e.locals = jit_calloc(data->locals_num + 1, sizeof(jit_ulong));
+        e.addressed = jit_calloc(data->locals_num + 1, sizeof(char));
+        e.escaped = 0;
+
+        //sets only grow, repeat until they do not change
+        jit_ulong* prev_locals = jit_malloc((data->locals_num + 1) * sizeof(jit_ulong));
+        int ok = 1;
+        int changed = 1;
+        while(ok && changed)
+        {
+            jit_ulong prev_escaped = e.escaped;
+            jit_memcpy(prev_locals, e.locals, (data->locals_num + 1) * sizeof(jit_ulong));
+
+            ok = tvm_escape_pass(&e, data, sites);
+            changed = prev_escaped != e.escaped ||
+                      jit_memcmp(prev_locals, e.locals, (data->locals_num + 1) * sizeof(jit_ulong)) != 0;
+        }
+        jit_free(prev_locals);
+
+        if(ok)
+        {
+            for(i = 0; i < len; ++i)
+                if(sites[i] != 0 && !(e.escaped & sites[i]))
+                    data->insns[i].flags |= TVM_INSN_STACK;
+        }
+
+        jit_free(e.stack);
+        jit_free(e.locals);
+        jit_free(e.addressed);
+    }
+
+    jit_free(sites);
+    jit_free(in_loop);
+}
@@ -28,6 +28,45 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+/*Blocks executed less than 1/TVM_PGO_COLD_RATIO times the hottest counter are moved out of line*/
+#define TVM_PGO_COLD_RATIO 64
+
+/*Max stack of inlined functions, the stack of the caller is extended by it*/
+#define TVM_INLINE_MAX_STACK 16
+
+/*Instructions inlined in a function are at most TVM_INLINE_GROWTH times its own plus the limit*/
+#define TVM_INLINE_GROWTH 2
+
+/*Callees that reached the tier threshold are inlined up to TVM_INLINE_HOT_FACTOR times the limit*/
+#define TVM_INLINE_HOT_FACTOR 2
+
+/*Indirect calls whose target is seen TVM_PGO_MONO_RATIO times more than the others are called directly*/
+#define TVM_PGO_MONO_RATIO 16
+
+/*Pure native calls whose result is reused and their max number of arguments*/
+#define TVM_CSE_CALLS 16
+#define TVM_CSE_MAX_ARGS 4
+
+/*Loads of locals remembered to compare the arguments of pure calls*/
+#define TVM_CSE_LOADS 64
+
+/*Free a tvm_func_data_t and its profile*/
+static void tvm_func_data_free
+    (void* ptr)
+{
+    tvm_func_data_t data = ptr;
+
+    int i;
+    for(i = 0; i < data->sites_num; ++i)
+        jit_free(data->site_counts[i]);
+
+    jit_free(data->site_counts);
+    jit_free(data->label_counts);
+    jit_free(data->call_profiles);
+    jit_free(data->insns);
+    jit_free(data);
+}
+
 tvm_func_data_t tvm_func_data_create
     (tvm_module_t module, unsigned char* begin, unsigned char* end, char* name, jit_ushort stack_len, jit_ushort locals_num, jit_ushort labels_num)
 {
@@ -39,443 +78,1027 @@ tvm_func_data_t tvm_func_data_create
     data->stack_len = stack_len;
     data->locals_num = locals_num;
     data->labels_num = labels_num;
+    data->insns = NULL;
+    data->insns_end = NULL;
+    data->max_stack = 0;
+    data->compile_ns = 0;
+    data->build_ns = 0;
+    data->codegen_ns = 0;
+    data->code_size = 0;
+    data->counter = 0;
+    data->tier = 0;
+    data->label_counts = NULL;
+    data->site_counts = NULL;
+    data->sites_num = 0;
+    data->call_profiles = NULL;
+    data->calls_num = 0;
+    data->native_entry = NULL;
     return data;
 }
 
 jit_function_t tvm_function_create
     (jit_type_t signature, tvm_func_data_t data)
 {
-    //create the jit function
-    jit_function_t func = jit_function_create(data->module->program->context, signature);
+    tvm_program_t program = data->module->program;
+
+    //create the jit function, the context functions list is not thread safe
+    pthread_mutex_lock(&program->lock);
+    jit_function_t func = jit_function_create(program->context, signature);
+    pthread_mutex_unlock(&program->lock);
 
     //set function data
-    jit_function_set_meta(func, 0, data, &jit_free, 1);
+    jit_function_set_meta(func, 0, data, &tvm_func_data_free, 1);
 
     //set build function
     jit_function_set_on_demand_compiler(func, &tvm_function_build);
 
+    //first tier functions are compiled again when hot
+    if(tvm_tier_threshold != 0)
+        jit_function_set_recompilable(func);
+
     return func;
 }
 
+void tvm_function_promote
+    (jit_function_t function)
+{
+    tvm_func_data_t data = tvm_function_get_data(function);
+    jit_context_t context = jit_function_get_context(function);
 
-int tvm_function_build
+    jit_context_build_start(context);
+
+    //another thread could have promoted it while waiting for the lock
+    if(data->tier == 0)
+    {
+        data->tier = 1;
+
+        //running invocations keep the old code, new calls go through the indirector
+        if(tvm_function_build(function) == JIT_RESULT_OK)
+            jit_function_compile(function);
+    }
+
+    jit_context_build_end(context);
+}
+
+/*Increment a counter in memory and get the new value*/
+static jit_value_t tvm_function_emit_increment
+    (jit_function_t function, jit_uint* counter)
+{
+    jit_value_t addr = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)counter);
+    jit_value_t count = jit_insn_load_relative(function, addr, 0, jit_type_uint);
+    count = jit_insn_add(function, count, jit_value_create_nint_constant(function, jit_type_uint, 1));
+    jit_insn_store_relative(function, addr, 0, count);
+    return count;
+}
+
+/*Count the outcome of the conditional jump number site, taken is 0 or 1*/
+static void tvm_function_emit_site_count
+    (jit_function_t function, tvm_func_data_t data, int site, jit_value_t taken)
+{
+    if(site >= data->sites_num)
+    {
+        //cells are never moved because their addresses are in the code
+        data->site_counts = jit_realloc(data->site_counts, sizeof(jit_uint*) * (site + 1));
+        data->site_counts[site] = jit_calloc(2, sizeof(jit_uint));
+        data->sites_num = site + 1;
+    }
+
+    jit_value_t base = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)data->site_counts[site]);
+    jit_value_t count = jit_insn_load_elem(function, base, taken, jit_type_uint);
+    count = jit_insn_add(function, count, jit_value_create_nint_constant(function, jit_type_uint, 1));
+    jit_insn_store_elem(function, base, taken, count);
+}
+
+/*Record the target of an indirect call, called by the first tier code*/
+static void tvm_function_profile_call
+    (tvm_call_profile_t* profile, void* target)
+{
+    if(profile->target == target)
+        ++profile->hits;
+    else if(profile->hits == 0)
+    {
+        profile->target = target;
+        profile->hits = 1;
+    }
+    else ++profile->misses;
+}
+
+/*Get the highest counter of the profile, 0 if there is no profile*/
+static jit_uint tvm_function_profile_max
+    (tvm_func_data_t data)
+{
+    jit_uint max = 0;
+
+    if(data->label_counts == NULL)
+        return 0;
+
+    int i;
+    for(i = 0; i < data->labels_num; ++i)
+        if(data->label_counts[i] > max)
+            max = data->label_counts[i];
+
+    for(i = 0; i < data->sites_num; ++i)
+    {
+        if(data->site_counts[i][0] > max)
+            max = data->site_counts[i][0];
+        if(data->site_counts[i][1] > max)
+            max = data->site_counts[i][1];
+    }
+
+    return max;
+}
+
+/*Increment the hotness counter and promote the function when it reaches the threshold*/
+static void tvm_function_emit_counter
+    (jit_function_t function, tvm_func_data_t data)
+{
+    jit_value_t count = tvm_function_emit_increment(function, &data->counter);
+
+    //equality so that the promotion is requested only once
+    jit_value_t threshold = jit_value_create_nint_constant(function, jit_type_uint, tvm_tier_threshold);
+    jit_label_t cold = jit_label_undefined;
+    jit_insn_branch_if_not(function, jit_insn_eq(function, count, threshold), &cold);
+
+    jit_value_t func_value = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)function);
+    jit_insn_call_native(function, "tvm_function_promote", &tvm_function_promote, tvm_promote_signature, &func_value, 1, JIT_CALL_NOTHROW);
+
+    jit_insn_label(function, &cold);
+}
+
+void tvm_function_compile
     (jit_function_t function)
 {
     tvm_func_data_t data = tvm_function_get_data(function);
+    jit_context_t context = jit_function_get_context(function);
 
-    //alloc vm stack
-    jit_value_t* stack = jit_malloc(data->stack_len * sizeof(jit_value_t));
-    jit_value_t* stack_base = stack;
+    jit_context_build_start(context);
 
-    //alloc local variables
-    jit_value_t* locals = jit_malloc(data->locals_num * sizeof(jit_value_t));
-printf("BUILD %p   %p\n",data->begin,data->end);
-    unsigned char* buf;
-    for(buf = data->begin; buf < data->end; ++buf)
-    {printf("%x   %x\n", *buf, OP_STORE_GBL);
-        switch(*buf)
+    if(!jit_function_is_compiled(function))
+    {
+        jit_ulong begin = tvm_clock_ns();
+
+        //on failure the function is left to the on demand compiler
+        if(tvm_function_build(function) == JIT_RESULT_OK)
+            jit_function_compile(function);
+
+        data->compile_ns = tvm_clock_ns() - begin;
+    }
+
+    jit_context_build_end(context);
+}
+
+void* tvm_function_native_entry
+    (jit_function_t function)
+{
+    tvm_func_data_t data = tvm_function_get_data(function);
+    jit_context_t context = jit_function_get_context(function);
+
+    jit_context_build_start(context);
+
+    if(data->native_entry == NULL)
+    {
+        //the host keeps the pointer, so the first tier is skipped and the function is not promoted later
+        int rebuild = !jit_function_is_compiled(function);
+        if(tvm_tier_threshold != 0 && data->tier == 0)
         {
-            case OP_NOP:
-            {
-                jit_insn_nop(function);
-                break;
-            }
-            case OP_LD_I8: //imm
-            {
-                *stack = jit_value_create_nint_constant(function, jit_type_sbyte, *(++buf));
-                ++stack;
-                break;
-            }
-            case OP_LD_U8: //imm
-            {
-                *stack = jit_value_create_nint_constant(function, jit_type_ubyte, *(++buf));
-                ++stack;
-                break;
-            }
-            case OP_LD_I16: //imm
-            {
-                jit_short tmp = tvm_short_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, jit_type_short, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_U16: //imm
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, jit_type_ushort, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_I32: //imm
-            {
-                jit_int tmp = tvm_int_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, jit_type_int, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_U32: //imm
-            {
-                jit_uint tmp = tvm_uint_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, jit_type_uint, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_I64: //imm
-            {
-                jit_long tmp = tvm_long_from_bytes(buf);
-                *stack = jit_value_create_long_constant(function, jit_type_long, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_U64: //imm
-            {
-                jit_ulong tmp = tvm_ulong_from_bytes(buf);
-                *stack = jit_value_create_long_constant(function, jit_type_ulong, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_F32: //imm
-            {
-                jit_float32 tmp = tvm_float32_from_bytes(buf);
-                *stack = jit_value_create_float32_constant(function, jit_type_float32, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_F64: //imm
-            {
-                jit_float64 tmp = tvm_float64_from_bytes(buf);
-                *stack = jit_value_create_float64_constant(function, jit_type_float64, tmp);
-                ++stack;
-                break;
-            }
-            case OP_LD_NULL:
-            {
-                *stack = jit_value_create_nint_constant(function, jit_type_void_ptr, NULL);
-                ++stack;
-                break;
-            }
-            case OP_LD_STR: //imm
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, tvm_type_string, data->module->strings[tmp]);
-                ++stack;
-                break;
-            }
-            case OP_ADDR:
-            {
-                --stack;
-                *stack = jit_insn_address_of(function, *stack);
-                ++stack;
-                break;
-            }
-            case OP_VAL:
-            {
-                --stack;
-                *stack = jit_insn_load_relative(function, *stack, 0, jit_type_get_ref(jit_value_get_type(*stack)));
-                ++stack;
-                break;
-            }
-            case OP_AT:
-            {
-                --stack;
-                jit_value_t idx = *stack;
-                --stack;
-                jit_type_t type = jit_type_get_ref(jit_value_get_type(*stack));
-                *stack = jit_insn_load_elem(function, *stack, idx, type);
-                ++stack;
-                break;
-            }
-            case OP_AT_C: //imm
-            {
-                jit_uint tmp = tvm_uint_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_type_get_ref(jit_value_get_type(*stack));
-                *stack = jit_insn_add_relative(function, *stack, tmp*jit_type_get_size(type));
-                ++stack;
-                break;
-            }
-            case OP_AT_1:
-            {
-                --stack;
-                jit_type_t type = jit_type_get_ref(jit_value_get_type(*stack));
-                *stack = jit_insn_add_relative(function, *stack, jit_type_get_size(type));
-                ++stack;
-                break;
-            }
-            case OP_AT_2:
-            {
-                --stack;
-                jit_type_t type = jit_type_get_ref(jit_value_get_type(*stack));
-                *stack = jit_insn_add_relative(function, *stack, 2*jit_type_get_size(type));
-                ++stack;
-                break;
-            }
-            case OP_AT_3:
-            {
-                --stack;
-                jit_type_t type = jit_type_get_ref(jit_value_get_type(*stack));
-                *stack = jit_insn_add_relative(function, *stack, 3*jit_type_get_size(type));
-                //++stack
-                break;
-            }
-            case OP_AD_AT:
-            {
-                --stack;
-                jit_value_t idx = *stack;
-                --stack;
-                jit_type_t type = jit_type_get_ref(jit_value_get_type(*stack));
-                *stack = jit_insn_load_elem_address(function, *stack, idx, type);
-                break;
-            }
-            case OP_AD_AT_C:
-            {
-                jit_uint tmp = tvm_uint_from_bytes(buf);
-                --stack;
-                *stack = jit_insn_add_relative(function, *stack, tmp*jit_type_get_size(jit_value_get_type(*stack)));
-                break;
-            }
-            case OP_AD_AT_1:
-            {
-                --stack;
-                *stack = jit_insn_add_relative(function, *stack, jit_type_get_size(jit_value_get_type(*stack)));
-                break;
-            }
-            case OP_AD_AT_2:
-            {
-                --stack;
-                *stack = jit_insn_add_relative(function, *stack, 2*jit_type_get_size(jit_value_get_type(*stack)));
-                break;
-            }
-            case OP_AD_AT_3:
-            {
-                --stack;
-                *stack = jit_insn_add_relative(function, *stack, 3*jit_type_get_size(jit_value_get_type(*stack)));
-                break;
-            }
-            case OP_FIELD:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_load_relative(function, *stack, jit_type_get_offset(type, tmp), jit_type_get_field(type, tmp));
-                break;
-            }
-            case OP_FIELD_0:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_load_relative(function, *stack, 0, jit_type_get_field(type, 0));
-                break;
-            }
-            case OP_FIELD_1:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_load_relative(function, *stack, jit_type_get_offset(type, 1), jit_type_get_field(type, 1));
-                break;
-            }
-            case OP_FIELD_2:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_load_relative(function, *stack, jit_type_get_offset(type, 2), jit_type_get_field(type, 2));
-                break;
-            }
-            case OP_FIELD_3:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_load_relative(function, *stack, jit_type_get_offset(type, 3), jit_type_get_field(type, 3));
-                break;
-            }
-            case OP_PT_FIELD:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_add_relative(function, *stack, jit_type_get_offset(type, tmp));
-                break;
-            }
-            case OP_PT_FIELD_0:
-            {
-                --stack;
-                jit_type_t type = jit_value_get_type(*stack);
-                *stack = jit_insn_address_of(function, stack[0]);
-                break;
-            }
-            case OP_PT_FIELD_1:
-            {
+            data->tier = 1;
+            rebuild = 1;
+        }
 
-                break;
-            }
-            case OP_PT_FIELD_2:
-            {
+        if(rebuild && tvm_function_build(function) == JIT_RESULT_OK)
+            jit_function_compile(function);
 
-                break;
-            }
-            case OP_PT_FIELD_3:
-            {
+        if(jit_function_is_compiled(function))
+        {
+            jit_function_clear_recompilable(function);
+            data->native_entry = jit_function_to_closure(function);
+        }
+    }
 
-                break;
-            }
-            case OP_AD_FIELD:
-            {
+    void* entry = data->native_entry;
+    jit_context_build_end(context);
+    return entry;
+}
+
+
+/*Type pointed by a value when the verifier could not resolve it*/
+static jit_type_t tvm_insn_ref_type
+    (tvm_insn_t* insn, jit_value_t value)
+{
+    if(insn->type != NULL)
+        return insn->type;
+    return jit_type_get_ref(jit_value_get_type(value));
+}
+
+/*Type and offset of the field of an instruction, struct_type is used when the verifier could not resolve them*/
+static jit_type_t tvm_insn_field
+    (tvm_insn_t* insn, jit_type_t struct_type, jit_nint* offset)
+{
+    if(insn->type != NULL)
+    {
+        *offset = insn->imm.nint;
+        return insn->type;
+    }
+
+    *offset = jit_type_get_offset(struct_type, insn->index);
+    return jit_type_get_field(struct_type, insn->index);
+}
+
+/*Check if two signatures pass arguments and results in the same way*/
+static int tvm_signature_compatible
+    (jit_type_t a, jit_type_t b)
+{
+    if(a == b)
+        return 1;
+    if(jit_type_get_abi(a) != jit_type_get_abi(b) || jit_type_num_params(a) != jit_type_num_params(b))
+        return 0;
+    if(jit_type_normalize(jit_type_get_return(a)) != jit_type_normalize(jit_type_get_return(b)))
+        return 0;
+
+    unsigned int i;
+    for(i = 0; i < jit_type_num_params(a); ++i)
+        if(jit_type_normalize(jit_type_get_param(a, i)) != jit_type_normalize(jit_type_get_param(b, i)))
+            return 0;
+
+    return 1;
+}
+
+/*
+Call the target of a monomorphic indirect call directly when the function pointer
+matches it, the indirect call is kept for the other targets.
+Targets that are Tripel functions are called as functions of the context.
+*/
+static jit_value_t tvm_function_emit_guarded_call
+    (jit_function_t function, tvm_insn_t* insn, jit_value_t funcptr, jit_value_t* args, unsigned int params_num, void* target)
+{
+    jit_type_t ret_type = jit_type_get_return(insn->type);
+    int has_result = jit_type_get_kind(ret_type) != JIT_TYPE_VOID;
+    jit_value_t result = has_result ? jit_value_create(function, ret_type) : NULL;
+
+    jit_label_t other = jit_label_undefined;
+    jit_label_t end = jit_label_undefined;
+
+    jit_value_t expected = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)target);
+    jit_insn_branch_if_not(function, jit_insn_eq(function, funcptr, expected), &other);
+
+    jit_value_t ret;
+    jit_function_t callee = jit_function_from_vtable_pointer(jit_function_get_context(function), target);
+    if(callee != NULL && tvm_signature_compatible(jit_function_get_signature(callee), insn->type))
+    {
+        tvm_func_data_t callee_data = tvm_function_get_data(callee);
+        ret = jit_insn_call(function, callee_data ? callee_data->name : NULL, callee, insn->type, args, params_num, 0);
+    }
+    else ret = jit_insn_call_native(function, NULL, target, insn->type, args, params_num, 0);
+
+    if(has_result)
+        jit_insn_store(function, result, ret);
+    jit_insn_branch(function, &end);
+
+    jit_insn_label(function, &other);
+    ret = jit_insn_call_indirect(function, funcptr, insn->type, args, params_num, 0);
+    if(has_result)
+        jit_insn_store(function, result, ret);
+
+    jit_insn_label(function, &end);
+    return result;
+}
 
+/*Check if a type is a number that jit_apply and libjit constants store in the same way*/
+static int tvm_type_foldable
+    (jit_type_t type)
+{
+    switch(jit_type_get_kind(jit_type_normalize(type)))
+    {
+        case JIT_TYPE_SBYTE:
+        case JIT_TYPE_UBYTE:
+        case JIT_TYPE_SHORT:
+        case JIT_TYPE_USHORT:
+        case JIT_TYPE_INT:
+        case JIT_TYPE_UINT:
+        case JIT_TYPE_LONG:
+        case JIT_TYPE_ULONG:
+        case JIT_TYPE_FLOAT32:
+        case JIT_TYPE_FLOAT64:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Evaluate a pure native call when its arguments are constant numbers,
+NULL if it must be called at runtime.
+Pointers are not folded because pure functions may read the memory they point.
+*/
+static jit_value_t tvm_function_fold_native
+    (jit_function_t function, tvm_funcptr_t* funcptr, jit_value_t* args, unsigned int params_num)
+{
+    jit_type_t ret_type = jit_type_normalize(jit_type_get_return(funcptr->signature));
+    if(!(funcptr->attributes & TVM_NATIVE_PURE) || !tvm_type_foldable(ret_type))
+        return NULL;
+
+    jit_constant_t* consts = jit_malloc((params_num + 1) * sizeof(jit_constant_t));
+    void** apply_args = jit_malloc((params_num + 1) * sizeof(void*));
+
+    unsigned int i;
+    for(i = 0; i < params_num; ++i)
+    {
+        jit_type_t param = jit_type_get_param(funcptr->signature, i);
+        if(!jit_value_is_constant(args[i]) || !tvm_type_foldable(param))
+            break;
+
+        jit_constant_t value = jit_value_get_constant(args[i]);
+        if(!jit_constant_convert(consts + i, &value, jit_type_normalize(param), 0))
+            break;
+        apply_args[i] = &consts[i].un;
+    }
+
+    jit_value_t result = NULL;
+    if(i == params_num)
+    {
+        jit_constant_t ret;
+        ret.type = ret_type;
+        jit_apply(funcptr->signature, funcptr->functor, apply_args, params_num, &ret.un);
+
+        //small integers are returned promoted to int
+        switch(jit_type_get_kind(ret_type))
+        {
+            case JIT_TYPE_SBYTE: ret.un.int_value = *(jit_sbyte*)&ret.un; break;
+            case JIT_TYPE_UBYTE: ret.un.int_value = *(jit_ubyte*)&ret.un; break;
+            case JIT_TYPE_SHORT: ret.un.int_value = *(jit_short*)&ret.un; break;
+            case JIT_TYPE_USHORT: ret.un.int_value = *(jit_ushort*)&ret.un; break;
+        }
+
+        result = jit_value_create_constant(function, &ret);
+    }
+
+    jit_free(consts);
+    jit_free(apply_args);
+    return result;
+}
+
+/*
+Pure native calls already emitted since the last label, store or impure call.
+A call to the same function with the same arguments reuses the result, the
+arguments are compared by the local they are loaded from or by constant value.
+Only numbers are passed and returned, a pointer may point to changed memory.
+*/
+struct _tvm_cse
+{
+    struct
+    {
+        tvm_funcptr_t* funcptr;
+        jit_value_t args[TVM_CSE_MAX_ARGS];
+        jit_value_t result;
+    } calls[TVM_CSE_CALLS];
+    int calls_num;
+
+    struct
+    {
+        jit_value_t value;
+        jit_value_t local;
+    } loads[TVM_CSE_LOADS];
+    int loads_num;
+};
+
+#define tvm_cse_clear(cse) ((cse)->calls_num = (cse)->loads_num = 0)
+
+/*Check if the values computed before an instruction are still valid after it*/
+static int tvm_cse_keeps
+    (tvm_insn_t* insn)
+{
+    switch(insn->opcode)
+    {
+        case OP_NOP:
+        case OP_LD_I8: case OP_LD_U8: case OP_LD_I16: case OP_LD_U16:
+        case OP_LD_I32: case OP_LD_U32: case OP_LD_I64: case OP_LD_U64:
+        case OP_LD_F32: case OP_LD_F64: case OP_LD_NULL: case OP_LD_STR:
+        case OP_VAL:
+        case OP_AT: case OP_AT_C: case OP_AT_1: case OP_AT_2: case OP_AT_3:
+        case OP_AD_AT: case OP_AD_AT_C: case OP_AD_AT_1: case OP_AD_AT_2: case OP_AD_AT_3:
+        case OP_FIELD: case OP_FIELD_0: case OP_FIELD_1: case OP_FIELD_2: case OP_FIELD_3:
+        case OP_PT_FIELD: case OP_PT_FIELD_0: case OP_PT_FIELD_1: case OP_PT_FIELD_2: case OP_PT_FIELD_3:
+        case OP_AD_PT_FIELD: case OP_AD_PT_FIELD_0: case OP_AD_PT_FIELD_1: case OP_AD_PT_FIELD_2: case OP_AD_PT_FIELD_3:
+        case OP_PUSH: case OP_PUSH_0: case OP_PUSH_1: case OP_PUSH_2: case OP_PUSH_3:
+        case OP_PUSH_ARG: case OP_PUSH_ARG_0: case OP_PUSH_ARG_1: case OP_PUSH_ARG_2: case OP_PUSH_ARG_3:
+        case OP_PUSH_GBL: case OP_PUSH_E_GBL:
+        case OP_POP: case OP_DUP:
+        case OP_FUNC_AD: case OP_E_FUNC_AD: case OP_N_FUNC_AD: case OP_EN_FUNC_AD:
+        case OP_SIZEOF: case OP_SIZEOF_T: case OP_SIZEOF_T_MUL:
+        case OP_MINUM: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_REM:
+        case OP_NEG: case OP_AND: case OP_OR: case OP_XOR: case OP_NOT: case OP_SHL: case OP_SHR:
+        case OP_EQ: case OP_NEQ: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+        case OP_IS_NULL: case OP_TO_BOOL: case OP_TO_BOOL_N:
+        case OP_CAST_I8: case OP_CAST_U8: case OP_CAST_I16: case OP_CAST_U16:
+        case OP_CAST_I32: case OP_CAST_U32: case OP_CAST_I64: case OP_CAST_U64:
+        case OP_CAST_F32: case OP_CAST_F64: case OP_CAST_VP: case OP_CAST_PT:
+        //the fall through is dominated by the code before the jump
+        case OP_JMP_IF: case OP_JMP_IF_N:
+        return 1;
+
+        case OP_N_CALL:
+        case OP_EN_CALL:
+        return (((tvm_funcptr_t*)insn->imm.ptr)->attributes & TVM_NATIVE_PURE) != 0;
+    }
+    return 0;
+}
+
+/*Remember that a value is a load of a local*/
+static void tvm_cse_load
+    (struct _tvm_cse* cse, jit_value_t value, jit_value_t local)
+{
+    if(cse->loads_num == TVM_CSE_LOADS)
+        return;
+    cse->loads[cse->loads_num].value = value;
+    cse->loads[cse->loads_num].local = local;
+    ++cse->loads_num;
+}
+
+/*The local loaded in a value, or the value itself*/
+static jit_value_t tvm_cse_origin
+    (struct _tvm_cse* cse, jit_value_t value)
+{
+    int i;
+    for(i = 0; i < cse->loads_num; ++i)
+        if(cse->loads[i].value == value)
+            return cse->loads[i].local;
+    return value;
+}
+
+/*Compare an origin with a remembered one, constants are compared by value*/
+static int tvm_cse_same
+    (jit_value_t a, jit_value_t b)
+{
+    if(a == b)
+        return 1;
+    if(!jit_value_is_constant(a) || !jit_value_is_constant(b))
+        return 0;
+
+    jit_type_t type = jit_type_normalize(jit_value_get_type(a));
+    if(type != jit_type_normalize(jit_value_get_type(b)))
+        return 0;
+
+    switch(jit_type_get_kind(type))
+    {
+        case JIT_TYPE_SBYTE:
+        case JIT_TYPE_UBYTE:
+        case JIT_TYPE_SHORT:
+        case JIT_TYPE_USHORT:
+        case JIT_TYPE_INT:
+        case JIT_TYPE_UINT:
+        case JIT_TYPE_NINT:
+        case JIT_TYPE_NUINT:
+        return jit_value_get_nint_constant(a) == jit_value_get_nint_constant(b);
+
+        case JIT_TYPE_LONG:
+        case JIT_TYPE_ULONG:
+        return jit_value_get_long_constant(a) == jit_value_get_long_constant(b);
+
+        case JIT_TYPE_FLOAT32:
+        return jit_value_get_float32_constant(a) == jit_value_get_float32_constant(b);
+
+        case JIT_TYPE_FLOAT64:
+        return jit_value_get_float64_constant(a) == jit_value_get_float64_constant(b);
+    }
+    return 0;
+}
+
+/*Check if a pure call has numbers as arguments and result and few arguments*/
+static int tvm_cse_eligible
+    (tvm_funcptr_t* funcptr, unsigned int params_num)
+{
+    if(!(funcptr->attributes & TVM_NATIVE_PURE) || params_num > TVM_CSE_MAX_ARGS ||
+       !tvm_type_foldable(jit_type_get_return(funcptr->signature)))
+        return 0;
+
+    unsigned int i;
+    for(i = 0; i < params_num; ++i)
+        if(!tvm_type_foldable(jit_type_get_param(funcptr->signature, i)))
+            return 0;
+    return 1;
+}
+
+/*Result of an equal pure call already emitted, NULL if there is none*/
+static jit_value_t tvm_cse_find
+    (struct _tvm_cse* cse, tvm_funcptr_t* funcptr, jit_value_t* args, unsigned int params_num)
+{
+    if(!tvm_cse_eligible(funcptr, params_num))
+        return NULL;
+
+    int i;
+    for(i = 0; i < cse->calls_num; ++i)
+    {
+        if(cse->calls[i].funcptr != funcptr)
+            continue;
+
+        unsigned int j;
+        for(j = 0; j < params_num; ++j)
+            if(!tvm_cse_same(cse->calls[i].args[j], tvm_cse_origin(cse, args[j])))
                 break;
-            }
+
+        if(j == params_num)
+            return cse->calls[i].result;
+    }
+    return NULL;
+}
+
+/*Remember the result of a pure call*/
+static void tvm_cse_add
+    (struct _tvm_cse* cse, tvm_funcptr_t* funcptr, jit_value_t* args, unsigned int params_num, jit_value_t result)
+{
+    if(cse->calls_num == TVM_CSE_CALLS || !tvm_cse_eligible(funcptr, params_num))
+        return;
+
+    unsigned int j;
+    for(j = 0; j < params_num; ++j)
+        cse->calls[cse->calls_num].args[j] = tvm_cse_origin(cse, args[j]);
+    cse->calls[cse->calls_num].funcptr = funcptr;
+    cse->calls[cse->calls_num].result = result;
+    ++cse->calls_num;
+}
+
+/*Check if a constant size allocation is popped from the free lists of the thread*/
+#define tvm_insn_gc_fast(insn) \
+    (((insn)->opcode == OP_GC_ALLOC_C || (insn)->opcode == OP_GC_ATOM_ALLOC_C) && \
+     !((insn)->flags & TVM_INSN_STACK) && tvm_gc_granules((insn)->imm.nint) < GC_TINY_FREELISTS)
+
+/*Pop an object from a free list of the thread cache, refill it when empty*/
+static jit_value_t tvm_function_emit_gc_pop
+    (jit_function_t function, jit_value_t cache, jit_nuint granules, int kind)
+{
+    jit_nint offset = (kind * GC_TINY_FREELISTS + granules) * sizeof(void*);
+    jit_value_t result = jit_value_create(function, jit_type_void_ptr);
+
+    jit_label_t refill = jit_label_undefined;
+    jit_label_t end = jit_label_undefined;
+
+    jit_value_t head = jit_insn_load_relative(function, cache, offset, jit_type_void_ptr);
+    jit_insn_branch_if_not(function, head, &refill);
+
+    jit_insn_store_relative(function, cache, offset, jit_insn_load_relative(function, head, 0, jit_type_void_ptr));
+
+    //the link is the only word not cleared by the collector
+    if(kind == GC_I_NORMAL)
+        jit_insn_store_relative(function, head, 0, jit_value_create_nint_constant(function, jit_type_void_ptr, 0));
+
+    jit_insn_store(function, result, head);
+    jit_insn_branch(function, &end);
+
+    jit_insn_label(function, &refill);
+
+    jit_value_t args[3];
+    args[0] = jit_insn_add_relative(function, cache, offset);
+    args[1] = jit_value_create_nint_constant(function, jit_type_nuint, granules);
+    args[2] = jit_value_create_nint_constant(function, jit_type_int, kind);
+    jit_insn_store(function, result, jit_insn_call_native(function, "tvm_gc_refill", &tvm_gc_refill, tvm_gc_refill_signature, args, 3, JIT_CALL_NOTHROW));
+
+    jit_insn_label(function, &end);
+    return result;
+}
+
+/*Check if calls with a signature push a result*/
+#define tvm_signature_has_result(signature) \
+    (jit_type_get_kind(jit_type_get_return(signature)) != JIT_TYPE_VOID)
+
+/*Check if the instruction after insn is a conditional jump, end is the end of the body*/
+#define tvm_insn_jumps_next(end, insn) \
+    ((insn) + 1 < (end) && ((insn)[1].opcode == OP_JMP_IF || (insn)[1].opcode == OP_JMP_IF_N))
+
+/*
+Check if a call can be replaced by the body of the callee.
+Recursion is not possible because inlined bodies are not inlined again.
+With tiers the first tier counter of the callee (calls and back edges) selects
+the hot callees, they are allowed to be bigger.
+*/
+static int tvm_function_inlinable
+    (jit_function_t function, jit_function_t callee, tvm_func_data_t callee_data)
+{
+    if(callee == function || callee_data == NULL || callee_data->insns == NULL)
+        return 0;
+
+    long limit = tvm_inline_limit;
+    if(tvm_tier_threshold != 0 && callee_data->counter >= tvm_tier_threshold)
+        limit *= TVM_INLINE_HOT_FACTOR;
+
+    if(callee_data->insns_end - callee_data->insns > limit || callee_data->max_stack > TVM_INLINE_MAX_STACK)
+        return 0;
+
+    //stack allocations in a loop of the caller would not be released at each iteration
+    tvm_insn_t* insn;
+    for(insn = callee_data->insns; insn < callee_data->insns_end; ++insn)
+        if(insn->opcode == OP_S_ALLOC || insn->opcode == OP_S_ALLOC_C)
+            return 0;
+
+    return 1;
+}
+
+/*Check if the function takes addresses in its frame, tail calls would release it while they are used*/
+static int tvm_function_frame_escapes
+    (tvm_func_data_t data)
+{
+    tvm_insn_t* insn;
+    for(insn = data->insns; insn < data->insns_end; ++insn)
+    {
+        switch(insn->opcode)
+        {
+            case OP_ADDR:
+            case OP_AD_FIELD:
             case OP_AD_FIELD_0:
-            {
+            case OP_AD_FIELD_1:
+            case OP_AD_FIELD_2:
+            case OP_AD_FIELD_3:
+            case OP_PUSH_AD:
+            case OP_PUSH_AD_0:
+            case OP_PUSH_AD_1:
+            case OP_PUSH_AD_2:
+            case OP_PUSH_AD_3:
+            case OP_S_ALLOC:
+            case OP_S_ALLOC_C:
+            return 1;
+        }
+
+        if(insn->flags & TVM_INSN_STACK)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*Check if a call at insn returns its result, or nothing for void calls, from the function*/
+#define tvm_insn_tail_call(end, insn) \
+    ((insn) + 1 < (end) && (insn)[1].opcode == (tvm_signature_has_result((insn)->type) ? OP_RET : OP_RET_STD))
+
+/*State of the caller saved while the body of an inlined callee is built*/
+struct _tvm_inline_frame
+{
+    tvm_insn_t* insn;//the call
+    tvm_insn_t* end;
+    jit_value_t* stack;
+    jit_value_t* locals;
+    jit_label_t* labels;
+    char* labels_placed;
+    int profiling;
+    jit_uint hottest;
+    int site;
+    int call_site;
+    int open_num;
+    jit_value_t result;//NULL when the callee returns void
+    jit_label_t return_label;
+
+    //guarded indirect call, the body is inlined when the pointer is the profiled target
+    jit_value_t* guard_args;//NULL for direct calls
+    jit_value_t guard_funcptr;
+    jit_label_t guard_other;
+};
+
+int tvm_function_build
+    (jit_function_t function)
+{
+    tvm_func_data_t data = tvm_function_get_data(function);
+
+    jit_ulong begin = tvm_stats_path ? tvm_clock_ns() : 0;
+
+    //bodies are inlined only in optimized code
+    int inlining = tvm_inline_limit > 0 && (tvm_tier_threshold == 0 || data->tier == 1);
+    long inline_budget = (data->insns_end - data->insns) * TVM_INLINE_GROWTH + tvm_inline_limit;
+
+    //the cache of the thread is loaded once if the function has small constant allocations
+    jit_value_t gc_cache = NULL;
+
+    tvm_insn_t* it;
+    for(it = data->insns; it < data->insns_end; ++it)
+    {
+        if(tvm_insn_gc_fast(it))
+        {
+            gc_cache = jit_insn_call_native(function, "tvm_gc_thread_cache", &tvm_gc_thread_cache, tvm_gc_cache_signature, NULL, 0, JIT_CALL_NOTHROW);
+            break;
+        }
+    }
+
+    //libjit makes tail calls only between identical signatures and checks it
+    int tail_calls = !tvm_function_frame_escapes(data);
+
+    //arguments of the inlined callee, NULL when building the function itself
+    jit_value_t* args = NULL;
+    struct _tvm_inline_frame frame;
+
+    //callee to inline after the current instruction and its arguments on the stack
+    jit_function_t inline_callee = NULL;
+    jit_value_t* inline_args = NULL;
+
+    //operands of a guarded indirect call whose target is inlined
+    jit_value_t* guard_args = NULL;
+    jit_value_t guard_funcptr = NULL;
+    jit_label_t guard_other = jit_label_undefined;
+
+    //alloc vm stack, the size is computed by the verifier
+    jit_value_t* stack = jit_malloc((data->max_stack + (inlining ? TVM_INLINE_MAX_STACK : 0) + 1) * sizeof(jit_value_t));
+    jit_value_t* stack_base = stack;
+
+    //alloc local variables
+    jit_value_t* locals = jit_malloc((data->locals_num + 1) * sizeof(jit_value_t));
+
+    //alloc labels, labels_placed marks the ones already met to detect back edges
+    jit_label_t* labels = jit_malloc((data->labels_num + 1) * sizeof(jit_label_t));
+    char* labels_placed = jit_calloc(data->labels_num + 1, sizeof(char));
+
+    int i;
+    for(i = 0; i < data->labels_num; ++i)
+        labels[i] = jit_label_undefined;
+
+    //branch profile is collected in the first tier and used in the second
+    int profiling = 0;
+    jit_uint hottest = 0;
+
+    if(tvm_tier_threshold != 0)
+    {
+        if(data->tier == 0)
+        {
+            //first tier, fast to compile and counts calls
+            jit_function_set_optimization_level(function, JIT_OPTLEVEL_NONE);
+            tvm_function_emit_counter(function, data);
 
-                break;
-            }
-            case OP_AD_FIELD_1:
+            if(tvm_pgo && data->label_counts == NULL)
             {
+                profiling = 1;
+                data->label_counts = jit_calloc(data->labels_num + 1, sizeof(jit_uint));
 
-                break;
+                //profiles addresses are in the code, the number of indirect calls is known
+                for(it = data->insns; it < data->insns_end; ++it)
+                    if(it->opcode == OP_CALL_PT)
+                        ++data->calls_num;
+                data->call_profiles = jit_calloc(data->calls_num + 1, sizeof(tvm_call_profile_t));
             }
-            case OP_AD_FIELD_2:
-            {
+        }
+        else
+        {
+            jit_function_set_optimization_level(function, jit_function_get_max_optimization_level());
 
-                break;
-            }
-            case OP_AD_FIELD_3:
-            {
+            if(tvm_pgo)
+                hottest = tvm_function_profile_max(data);
+        }
+    }
 
-                break;
-            }
-            case OP_AD_PT_FIELD:
-            {
+    //conditional jumps and indirect calls are numbered in bytecode order
+    int site = 0;
+    int call_site = 0;
+
+    //cold regions still open and regions to move out of line at the end
+    jit_label_t* open_regions = NULL;
+    jit_label_t* moves_from = NULL;
+    jit_label_t* moves_to = NULL;
+    int open_num = 0;
+    int moves_num = 0;
+
+    if(hottest != 0)
+    {
+        open_regions = jit_malloc((data->sites_num + 1) * sizeof(jit_label_t));
+        moves_from = jit_malloc((data->sites_num + data->labels_num) * sizeof(jit_label_t));
+        moves_to = jit_malloc((data->sites_num + data->labels_num) * sizeof(jit_label_t));
+    }
 
-                break;
-            }
-            case OP_AD_PT_FIELD_0:
-            {
+    //a condition followed by a conditional jump is fused with it, the back edge
+    //counter is emitted before the condition and the jump sense may be negated
+    int counted = 0;
+    int negated = 0;
 
-                break;
-            }
-            case OP_AD_PT_FIELD_1:
-            {
+    //results of pure calls, reused until the next label, store or impure call
+    struct _tvm_cse cse;
+    tvm_cse_clear(&cse);
 
-                break;
-            }
-            case OP_AD_PT_FIELD_2:
-            {
+    int result = JIT_RESULT_OK;
 
-                break;
-            }
-            case OP_AD_PT_FIELD_3:
-            {
+    //operands and stack effects are already checked by tvm_function_verify
+    tvm_insn_t* insn = data->insns;
+    tvm_insn_t* end = data->insns_end;
+    while(result == JIT_RESULT_OK)
+    {
+        if(insn == end)
+        {
+            if(args == NULL)
+                break;
+
+            //end of an inlined body, return to the caller
+            jit_insn_label(function, &frame.return_label);
+            tvm_cse_clear(&cse);
+
+            if(frame.guard_args != NULL)
+            {
+                //the other targets of the guarded call
+                jit_label_t guard_end = jit_label_undefined;
+                jit_insn_branch(function, &guard_end);
+                jit_insn_label(function, &frame.guard_other);
+
+                jit_type_t signature = frame.insn->type;
+                jit_value_t ret = jit_insn_call_indirect(function, frame.guard_funcptr, signature, frame.guard_args, jit_type_num_params(signature), 0);
+                if(frame.result != NULL)
+                    jit_insn_store(function, frame.result, ret);
+
+                jit_insn_label(function, &guard_end);
+                jit_free(frame.guard_args);
+            }
+
+            jit_free(args);
+            jit_free(locals);
+            jit_free(labels);
+            jit_free(labels_placed);
+            args = NULL;
+
+            insn = frame.insn + 1;
+            end = frame.end;
+            stack = frame.stack;
+            locals = frame.locals;
+            labels = frame.labels;
+            labels_placed = frame.labels_placed;
+            profiling = frame.profiling;
+            hottest = frame.hottest;
+            site = frame.site;
+            call_site = frame.call_site;
+            open_num = frame.open_num;
+
+            if(frame.result != NULL)
+                *(stack++) = frame.result;
+            continue;
+        }
+
+        if(!tvm_cse_keeps(insn))
+            tvm_cse_clear(&cse);
 
+        switch(insn->opcode)
+        {
+            case OP_NOP:
+            {
+                jit_insn_nop(function);
                 break;
             }
-            case OP_PUSH:
+            case OP_LD_I8:
+            case OP_LD_U8:
+            case OP_LD_I16:
+            case OP_LD_U16:
+            case OP_LD_I32:
+            case OP_LD_U32:
+            case OP_LD_NULL:
+            case OP_LD_STR:
             {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_insn_load(function, locals[tmp]);
+                *stack = jit_value_create_nint_constant(function, insn->type, insn->imm.nint);
                 ++stack;
                 break;
             }
-            case OP_PUSH_0:
+            case OP_LD_I64:
+            case OP_LD_U64:
             {
-                *stack = jit_insn_load(function, locals[0]);
+                *stack = jit_value_create_long_constant(function, insn->type, insn->imm.lval);
                 ++stack;
                 break;
             }
-            case OP_PUSH_1:
+            case OP_LD_F32:
             {
-                *stack = jit_insn_load(function, locals[1]);
+                *stack = jit_value_create_float32_constant(function, insn->type, insn->imm.f32);
                 ++stack;
                 break;
             }
-            case OP_PUSH_2:
+            case OP_LD_F64:
             {
-                *stack = jit_insn_load(function, locals[2]);
+                *stack = jit_value_create_float64_constant(function, insn->type, insn->imm.f64);
                 ++stack;
                 break;
             }
-            case OP_PUSH_3:
+            case OP_ADDR:
             {
-                *stack = jit_insn_load(function, locals[3]);
+                --stack;
+                *stack = jit_insn_address_of(function, *stack);
                 ++stack;
                 break;
             }
-            case OP_PUSH_AD:
+            case OP_VAL:
             {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_insn_address_of(function, locals[tmp]);
+                --stack;
+                *stack = jit_insn_load_relative(function, *stack, 0, tvm_insn_ref_type(insn, *stack));
                 ++stack;
                 break;
             }
-            case OP_PUSH_AD_0:
+            case OP_AT:
+            case OP_AD_AT:
             {
-                *stack = jit_insn_address_of(function, locals[0]);
+                --stack;
+                jit_value_t idx = *stack;
+                --stack;
+                jit_type_t type = tvm_insn_ref_type(insn, *stack);
+                if(insn->opcode == OP_AT)
+                    *stack = jit_insn_load_elem(function, *stack, idx, type);
+                else
+                    *stack = jit_insn_load_elem_address(function, *stack, idx, type);
                 ++stack;
                 break;
             }
-            case OP_PUSH_AD_1:
+            case OP_AT_C:
+            case OP_AT_1:
+            case OP_AT_2:
+            case OP_AT_3:
             {
-                *stack = jit_insn_address_of(function, locals[1]);
+                --stack;
+                jit_type_t type = tvm_insn_ref_type(insn, *stack);
+                *stack = jit_insn_load_relative(function, *stack, insn->imm.nint * jit_type_get_size(type), type);
                 ++stack;
                 break;
             }
-            case OP_PUSH_AD_2:
+            case OP_AD_AT_C:
+            case OP_AD_AT_1:
+            case OP_AD_AT_2:
+            case OP_AD_AT_3:
             {
-                *stack = jit_insn_address_of(function, locals[2]);
+                --stack;
+                jit_type_t type = tvm_insn_ref_type(insn, *stack);
+                *stack = jit_insn_add_relative(function, *stack, insn->imm.nint * jit_type_get_size(type));
                 ++stack;
                 break;
             }
-            case OP_PUSH_AD_3:
+            case OP_FIELD:
+            case OP_FIELD_0:
+            case OP_FIELD_1:
+            case OP_FIELD_2:
+            case OP_FIELD_3:
             {
-                *stack = jit_insn_address_of(function, locals[3]);
+                jit_nint offset;
+                --stack;
+                jit_type_t type = tvm_insn_field(insn, jit_value_get_type(*stack), &offset);
+                *stack = jit_insn_load_relative(function, jit_insn_address_of(function, *stack), offset, type);
                 ++stack;
                 break;
             }
-            case OP_PUSH_ARG:
+            case OP_PT_FIELD:
+            case OP_PT_FIELD_0:
+            case OP_PT_FIELD_1:
+            case OP_PT_FIELD_2:
+            case OP_PT_FIELD_3:
             {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_value_get_param(function, tmp);
+                jit_nint offset;
+                --stack;
+                jit_type_t type = tvm_insn_field(insn, jit_type_get_ref(jit_value_get_type(*stack)), &offset);
+                *stack = jit_insn_load_relative(function, *stack, offset, type);
                 ++stack;
                 break;
             }
-            case OP_PUSH_ARG_0:
+            case OP_AD_FIELD:
+            case OP_AD_FIELD_0:
+            case OP_AD_FIELD_1:
+            case OP_AD_FIELD_2:
+            case OP_AD_FIELD_3:
             {
-                *stack = jit_value_get_param(function, 0);
+                jit_nint offset;
+                --stack;
+                tvm_insn_field(insn, jit_value_get_type(*stack), &offset);
+                *stack = jit_insn_add_relative(function, jit_insn_address_of(function, *stack), offset);
                 ++stack;
                 break;
             }
-            case OP_PUSH_ARG_1:
+            case OP_AD_PT_FIELD:
+            case OP_AD_PT_FIELD_0:
+            case OP_AD_PT_FIELD_1:
+            case OP_AD_PT_FIELD_2:
+            case OP_AD_PT_FIELD_3:
             {
-                *stack = jit_value_get_param(function, 1);
+                jit_nint offset;
+                --stack;
+                tvm_insn_field(insn, jit_type_get_ref(jit_value_get_type(*stack)), &offset);
+                *stack = jit_insn_add_relative(function, *stack, offset);
                 ++stack;
                 break;
             }
-            case OP_PUSH_ARG_2:
+            case OP_PUSH:
+            case OP_PUSH_0:
+            case OP_PUSH_1:
+            case OP_PUSH_2:
+            case OP_PUSH_3:
             {
-                *stack = jit_value_get_param(function, 2);
+                *stack = jit_insn_load(function, locals[insn->index]);
+                tvm_cse_load(&cse, *stack, locals[insn->index]);
                 ++stack;
                 break;
             }
-            case OP_PUSH_ARG_3:
+            case OP_PUSH_AD:
+            case OP_PUSH_AD_0:
+            case OP_PUSH_AD_1:
+            case OP_PUSH_AD_2:
+            case OP_PUSH_AD_3:
             {
-                *stack = jit_value_get_param(function, 3);
+                *stack = jit_insn_address_of(function, locals[insn->index]);
                 ++stack;
                 break;
             }
-            case OP_PUSH_GBL:
+            case OP_PUSH_ARG:
+            case OP_PUSH_ARG_0:
+            case OP_PUSH_ARG_1:
+            case OP_PUSH_ARG_2:
+            case OP_PUSH_ARG_3:
             {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, data->module->globals[tmp].type, data->module->globals[tmp].data);
+                *stack = args ? args[insn->index] : jit_value_get_param(function, insn->index);
                 ++stack;
                 break;
             }
+            case OP_PUSH_GBL:
             case OP_PUSH_E_GBL:
             {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                *stack = jit_value_create_nint_constant(function, data->module->ext_globals[tmp]->type, data->module->ext_globals[tmp]->data);
+                *stack = jit_value_create_nint_constant(function, insn->type, (jit_nint)insn->imm.ptr);
                 ++stack;
                 break;
             }
@@ -487,587 +1110,654 @@ printf("BUILD %p   %p\n",data->begin,data->end);
             case OP_DUP:
             {
                 *stack = jit_insn_load(function, *(stack-1));
+                tvm_cse_load(&cse, *stack, tvm_cse_origin(&cse, *(stack-1)));
                 ++stack;
                 break;
             }
             case OP_CLEAR:
             {
-                stack = stack_base;
+                //an inlined body clears only its own part, the operands of the caller are below it
+                stack = args != NULL ? frame.stack : stack_base;
                 break;
             }
             case OP_DECL_I8:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_sbyte);
-                break;
-            }
             case OP_DECL_U8:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_ubyte);
-                break;
-            }
             case OP_DECL_I16:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_short);
-                break;
-            }
             case OP_DECL_U16:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_ushort);
-                break;
-            }
             case OP_DECL_I32:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_int);
-                break;
-            }
             case OP_DECL_U32:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_uint);
-                break;
-            }
             case OP_DECL_I64:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_long);
-                break;
-            }
             case OP_DECL_U64:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_ulong);
-                break;
-            }
             case OP_DECL_F32:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_float32);
-                break;
-            }
             case OP_DECL_F64:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_float64);
-                break;
-            }
             case OP_DECL_VP:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                locals[tmp] = jit_value_create(function, jit_type_void_ptr);
-                break;
-            }
             case OP_DECL_PT:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                jit_type_t type = tvm_module_get_pointer_type(data->module, &buf);
-                locals[tmp] = jit_value_create(function, type);
-                break;
-            }
             case OP_DECL_ST:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                jit_ushort idx = tvm_ushort_from_bytes(buf);
-                jit_type_t type = data->module->structs[idx].type;
-                locals[tmp] = jit_value_create(function, type);
-                break;
-            }
             case OP_DECL_E_ST:
-            {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                jit_ushort idx = tvm_ushort_from_bytes(buf);
-                jit_type_t type = data->module->ext_structs[idx]->type;
-                locals[tmp] = jit_value_create(function, type);
-                break;
-            }
             case OP_DECL_T:
             {
-
+                locals[insn->index] = jit_value_create(function, insn->type);
                 break;
             }
             case OP_STORE:
-            {
-
-                break;
-            }
             case OP_STORE_0:
-            {
-
-                break;
-            }
             case OP_STORE_1:
-            {
-
-                break;
-            }
             case OP_STORE_2:
-            {
-
-                break;
-            }
             case OP_STORE_3:
             {
-
+                --stack;
+                jit_insn_store(function, locals[insn->index], *stack);
                 break;
             }
             case OP_STORE_VAL:
-            {
-
-                break;
-            }
             case OP_STORE_VAL_0:
-            {
-
-                break;
-            }
             case OP_STORE_VAL_1:
-            {
-
-                break;
-            }
             case OP_STORE_VAL_2:
-            {
-
-                break;
-            }
             case OP_STORE_VAL_3:
             {
-
+                //the local is a pointer
+                --stack;
+                jit_insn_store_relative(function, locals[insn->index], 0, *stack);
                 break;
             }
             case OP_STORE_GBL:
+            case OP_STORE_E_GBL:
             {
-                jit_ushort tmp = tvm_ushort_from_bytes(buf);
-                jit_value_t addr = jit_value_create_nint_constant(function, data->module->globals[tmp].type, data->module->globals[tmp].data);
+                jit_value_t addr = jit_value_create_nint_constant(function, insn->type, (jit_nint)insn->imm.ptr);
                 --stack;
                 jit_insn_store_relative(function, addr, 0, *stack);
                 break;
             }
-            case OP_STORE_E_GBL:
-            {
-
-                break;
-            }
             case OP_SET_AT:
             {
-
+                stack -= 3;
+                jit_insn_store_elem(function, stack[0], stack[1], stack[2]);
                 break;
             }
             case OP_SET_AT_0:
-            {
-
-                break;
-            }
             case OP_SET_AT_1:
-            {
-
-                break;
-            }
             case OP_SET_AT_2:
-            {
-
-                break;
-            }
             case OP_SET_AT_3:
-            {
-
-                break;
-            }
             case OP_SET_AT_C:
             {
-
+                stack -= 2;
+                jit_type_t type = tvm_insn_ref_type(insn, stack[0]);
+                jit_insn_store_relative(function, stack[0], insn->imm.nint * jit_type_get_size(type), stack[1]);
                 break;
             }
             case OP_SET_FIELD:
-            {
-
-                break;
-            }
             case OP_SET_FIELD_0:
-            {
-
-                break;
-            }
             case OP_SET_FIELD_1:
-            {
-
-                break;
-            }
             case OP_SET_FIELD_2:
-            {
-
-                break;
-            }
             case OP_SET_FIELD_3:
             {
-
+                --stack;
+                jit_value_t addr = jit_insn_address_of(function, locals[insn->index]);
+                jit_insn_store_relative(function, addr, insn->imm.nint, *stack);
                 break;
             }
             case OP_SET_PT_FIELD:
-            {
-
-                break;
-            }
             case OP_SET_PT_FIELD_0:
-            {
-
-                break;
-            }
             case OP_SET_PT_FIELD_1:
-            {
-
-                break;
-            }
-            case OP_SET_PT_FIELD_2:
-            {
-
-                break;
-            }
+            case OP_SET_PT_FIELD_2:
             case OP_SET_PT_FIELD_3:
             {
-
+                jit_nint offset;
+                stack -= 2;
+                tvm_insn_field(insn, jit_type_get_ref(jit_value_get_type(stack[0])), &offset);
+                jit_insn_store_relative(function, stack[0], offset, stack[1]);
                 break;
             }
             case OP_S_ALLOC:
             {
-
+                --stack;
+                *stack = jit_insn_alloca(function, *stack);
+                ++stack;
                 break;
             }
             case OP_S_ALLOC_C:
             {
-
+                *stack = jit_insn_alloca(function, jit_value_create_nint_constant(function, jit_type_nuint, insn->imm.nint));
+                ++stack;
                 break;
             }
             case OP_GC_ALLOC:
+            case OP_GC_ATOM_ALLOC:
+            case OP_GC_ALLOC_C:
+            case OP_GC_ATOM_ALLOC_C:
             {
-
+                //objects that do not escape live in the frame, inlined bodies could be in a loop of the caller
+                if((insn->flags & TVM_INSN_STACK) && args == NULL)
+                {
+                    jit_value_t stack_size = jit_value_create_nint_constant(function, jit_type_nuint, insn->imm.nint);
+                    *stack = jit_insn_alloca(function, stack_size);
+
+                    //GC_malloc clears the memory
+                    if(insn->opcode == OP_GC_ALLOC_C)
+                        jit_insn_memset(function, *stack, jit_value_create_nint_constant(function, jit_type_ubyte, 0), stack_size);
+                    ++stack;
+                    break;
+                }
+
+                if(gc_cache != NULL && tvm_insn_gc_fast(insn))
+                {
+                    int kind = insn->opcode == OP_GC_ALLOC_C ? GC_I_NORMAL : GC_I_PTRFREE;
+                    *stack = tvm_function_emit_gc_pop(function, gc_cache, tvm_gc_granules(insn->imm.nint), kind);
+                    ++stack;
+                    break;
+                }
+
+                jit_value_t size;
+                if(insn->opcode == OP_GC_ALLOC_C || insn->opcode == OP_GC_ATOM_ALLOC_C)
+                    size = jit_value_create_long_constant(function, jit_type_ulong, insn->imm.nint);
+                else
+                {
+                    --stack;
+                    size = jit_insn_convert(function, *stack, jit_type_ulong, 0);
+                }
+
+                if(insn->opcode == OP_GC_ALLOC || insn->opcode == OP_GC_ALLOC_C)
+                    *stack = jit_insn_call_native(function, "GC_malloc", &GC_malloc, tvm_gc_malloc_signature, &size, 1, JIT_CALL_NOTHROW);
+                else
+                    *stack = jit_insn_call_native(function, "GC_malloc_atomic", &GC_malloc_atomic, tvm_gc_malloc_signature, &size, 1, JIT_CALL_NOTHROW);
+                ++stack;
                 break;
             }
-            case OP_GC_ALLOC_C:
+            case OP_GC_ALLOC_ST:
+            case OP_GC_ALLOC_E_ST:
+            case OP_GC_ARRAY_ST:
+            case OP_GC_ARRAY_E_ST:
             {
+                //the collector scans only the words of the pointer fields
+                tvm_struct_t* st = insn->imm.ptr;
+                jit_value_t gc_args[3];
+                int gc_args_num = 0;
+
+                if(insn->opcode == OP_GC_ARRAY_ST || insn->opcode == OP_GC_ARRAY_E_ST)
+                {
+                    --stack;
+                    gc_args[gc_args_num++] = jit_insn_convert(function, *stack, jit_type_ulong, 0);
+                }
+                gc_args[gc_args_num++] = jit_value_create_long_constant(function, jit_type_ulong, jit_type_get_size(st->type));
+                gc_args[gc_args_num++] = jit_value_create_long_constant(function, jit_type_ulong, st->descr);
 
+                jit_value_t object;
+                if(gc_args_num == 2)
+                    object = jit_insn_call_native(function, "GC_malloc_explicitly_typed", &GC_malloc_explicitly_typed, tvm_gc_typed_malloc_signature, gc_args, 2, JIT_CALL_NOTHROW);
+                else
+                    object = jit_insn_call_native(function, "GC_calloc_explicitly_typed", &GC_calloc_explicitly_typed, tvm_gc_typed_calloc_signature, gc_args, 3, JIT_CALL_NOTHROW);
+
+                *stack = jit_insn_convert(function, object, insn->type, 0);
+                ++stack;
                 break;
             }
-            case OP_GC_ATOM_ALLOC:
+            case OP_SPAWN:
+            case OP_E_SPAWN:
             {
-
+                jit_value_t spawn_args[2];
+                spawn_args[0] = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)insn->imm.ptr);
+                --stack;
+                spawn_args[1] = jit_insn_convert(function, *stack, jit_type_void_ptr, 0);
+                *stack = jit_insn_call_native(function, "tvm_thread_spawn", &tvm_thread_spawn, tvm_thread_spawn_signature, spawn_args, 2, JIT_CALL_NOTHROW);
+                ++stack;
                 break;
             }
-            case OP_GC_ATOM_ALLOC_C:
+            case OP_JOIN:
             {
-
+                --stack;
+                jit_value_t handle = jit_insn_convert(function, *stack, jit_type_void_ptr, 0);
+                *stack = jit_insn_call_native(function, "tvm_thread_join", &tvm_thread_join, tvm_thread_join_signature, &handle, 1, JIT_CALL_NOTHROW);
+                ++stack;
                 break;
             }
             case OP_CALL:
+            case OP_E_CALL:
             {
+                jit_function_t callee = insn->imm.ptr;
+                tvm_func_data_t callee_data = tvm_function_get_data(callee);
+                unsigned int params_num = jit_type_num_params(insn->type);
+                stack -= params_num;
 
-                break;
-            }
-            case OP_N_CALL:
-            {
+                if(inlining && args == NULL && tvm_function_inlinable(function, callee, callee_data) &&
+                   callee_data->insns_end - callee_data->insns <= inline_budget)
+                {
+                    //the body is entered after the switch
+                    inline_callee = callee;
+                    inline_args = stack;
+                    break;
+                }
+
+                //the return after a tail call is left as dead code
+                int call_flags = args == NULL && tail_calls && tvm_insn_tail_call(end, insn) ? JIT_CALL_TAIL : 0;
 
+                jit_value_t ret = jit_insn_call(function, callee_data->name, callee, NULL, stack, params_num, call_flags);
+                if(tvm_signature_has_result(insn->type))
+                    *(stack++) = ret;
                 break;
             }
-            case OP_E_CALL:
+            case OP_N_CALL:
+            case OP_EN_CALL:
             {
-
+                tvm_funcptr_t* funcptr = insn->imm.ptr;
+                unsigned int params_num = jit_type_num_params(insn->type);
+                stack -= params_num;
+                jit_value_t ret = tvm_function_fold_native(function, funcptr, stack, params_num);
+                if(ret == NULL && (ret = tvm_cse_find(&cse, funcptr, stack, params_num)) != NULL)
+                    ret = jit_insn_load(function, ret);
+                if(ret == NULL)
+                {
+                    ret = jit_insn_call_native(function, NULL, funcptr->functor, insn->type, stack, params_num, funcptr->call_flags);
+                    tvm_cse_add(&cse, funcptr, stack, params_num, ret);
+                }
+                if(tvm_signature_has_result(insn->type))
+                    *(stack++) = ret;
                 break;
             }
-            case OP_EN_CALL:
+            case OP_CALL_PT:
             {
+                unsigned int params_num = jit_type_num_params(insn->type);
+                stack -= params_num;
+                jit_value_t* call_args = stack;
+                --stack;
 
+                //sites of inlined bodies have no profile, the counter is restored at the end of the body
+                tvm_call_profile_t* profile = args == NULL && call_site < data->calls_num ? data->call_profiles + call_site : NULL;
+                ++call_site;
+
+                if(profiling && profile != NULL)
+                {
+                    jit_value_t profile_args[2];
+                    profile_args[0] = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)profile);
+                    profile_args[1] = *stack;
+                    jit_insn_call_native(function, "tvm_function_profile_call", &tvm_function_profile_call, tvm_profile_call_signature, profile_args, 2, JIT_CALL_NOTHROW);
+                }
+
+                int monomorphic = data->tier == 1 && profile != NULL && profile->hits != 0 &&
+                                  (jit_ulong)profile->misses * TVM_PGO_MONO_RATIO <= profile->hits;
+
+                if(monomorphic && inlining && args == NULL)
+                {
+                    //a Tripel target is inlined under the guard, the other targets are called at the end of the body
+                    jit_function_t callee = jit_function_from_vtable_pointer(jit_function_get_context(function), profile->target);
+                    tvm_func_data_t callee_data = callee ? tvm_function_get_data(callee) : NULL;
+
+                    if(callee_data != NULL && tvm_signature_compatible(jit_function_get_signature(callee), insn->type) &&
+                       tvm_function_inlinable(function, callee, callee_data) &&
+                       callee_data->insns_end - callee_data->insns <= inline_budget)
+                    {
+                        //the body reuses the stack from the function pointer up
+                        guard_funcptr = *stack;
+                        guard_args = jit_malloc((params_num + 1) * sizeof(jit_value_t));
+                        jit_memcpy(guard_args, call_args, params_num * sizeof(jit_value_t));
+                        guard_other = jit_label_undefined;
+
+                        jit_value_t expected = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)profile->target);
+                        jit_insn_branch_if_not(function, jit_insn_eq(function, guard_funcptr, expected), &guard_other);
+
+                        inline_callee = callee;
+                        inline_args = guard_args;
+                        break;
+                    }
+                }
+
+                jit_value_t ret;
+                if(monomorphic)
+                    ret = tvm_function_emit_guarded_call(function, insn, *stack, call_args, params_num, profile->target);
+                else ret = jit_insn_call_indirect(function, *stack, insn->type, call_args, params_num, 0);
+
+                if(tvm_signature_has_result(insn->type))
+                    *(stack++) = ret;
                 break;
             }
             case OP_RET:
             {
-
+                --stack;
+                if(args != NULL)
+                {
+                    if(frame.result != NULL)
+                        jit_insn_store(function, frame.result, *stack);
+                    jit_insn_branch(function, &frame.return_label);
+                }
+                else jit_insn_return(function, *stack);
                 break;
             }
             case OP_RET_STD:
             {
-
+                if(args != NULL)
+                    jit_insn_branch(function, &frame.return_label);
+                else jit_insn_default_return(function);
                 break;
             }
             case OP_FUNC_AD:
-            {
-
-                break;
-            }
             case OP_E_FUNC_AD:
             {
-
+                //the vtable pointer compiles the function on its first call
+                void* ptr = jit_function_to_vtable_pointer(insn->imm.ptr);
+                *stack = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)ptr);
+                ++stack;
                 break;
             }
             case OP_N_FUNC_AD:
-            {
-
-                break;
-            }
             case OP_EN_FUNC_AD:
             {
-
-                break;
-            }
-            case OP_CALL_PT:
-            {
-
+                tvm_funcptr_t* funcptr = insn->imm.ptr;
+                *stack = jit_value_create_nint_constant(function, jit_type_void_ptr, (jit_nint)funcptr->functor);
+                ++stack;
                 break;
             }
             case OP_VAL_ASSIGN:
             {
-
+                stack -= 2;
+                jit_insn_store_relative(function, stack[0], 0, stack[1]);
                 break;
             }
             case OP_SIZEOF:
             {
-
+                --stack;
+                jit_nint size = jit_type_get_size(jit_value_get_type(*stack));
+                *stack = jit_value_create_nint_constant(function, jit_type_nuint, size);
+                ++stack;
                 break;
             }
             case OP_SIZEOF_T:
             {
-
+                *stack = jit_value_create_nint_constant(function, jit_type_nuint, insn->imm.nint);
+                ++stack;
                 break;
             }
             case OP_SIZEOF_T_MUL:
             {
-
+                --stack;
+                jit_value_t size = jit_value_create_nint_constant(function, jit_type_nuint, insn->imm.nint);
+                *stack = jit_insn_mul(function, *stack, size);
+                ++stack;
                 break;
             }
             case OP_MINUM:
             {
-
-                break;
-            }
-            case OP_ADD:
-            {
-
-                break;
-            }
-            case OP_SUB:
-            {
-
-                break;
-            }
-            case OP_MUL:
-            {
-
-                break;
-            }
-            case OP_DIV:
-            {
-
-                break;
-            }
-            case OP_REM:
-            {
-
+                --stack;
+                *stack = jit_insn_neg(function, *stack);
+                ++stack;
                 break;
             }
             case OP_INC:
-            {
-
-                break;
-            }
             case OP_DEC:
             {
-
+                --stack;
+                jit_value_t one = jit_value_create_nint_constant(function, jit_type_int, 1);
+                if(insn->opcode == OP_INC)
+                    *stack = jit_insn_add(function, *stack, one);
+                else
+                    *stack = jit_insn_sub(function, *stack, one);
+                ++stack;
                 break;
             }
             case OP_NEG:
+            case OP_IS_NULL:
+            case OP_TO_BOOL_N:
             {
-
-                break;
-            }
-            case OP_AND:
-            {
-
-                break;
-            }
-            case OP_OR:
-            {
-
+                //the jump tests the value itself
+                if(tvm_insn_jumps_next(end, insn))
+                {
+                    negated = 1;
+                    break;
+                }
+                --stack;
+                *stack = jit_insn_to_not_bool(function, *stack);
+                ++stack;
                 break;
             }
-            case OP_XOR:
+            case OP_TO_BOOL:
             {
-
+                if(tvm_insn_jumps_next(end, insn))
+                    break;
+                --stack;
+                *stack = jit_insn_to_bool(function, *stack);
+                ++stack;
                 break;
             }
             case OP_NOT:
             {
-
+                --stack;
+                *stack = jit_insn_not(function, *stack);
+                ++stack;
                 break;
             }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_REM:
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
             case OP_SHL:
-            {
-
-                break;
-            }
             case OP_SHR:
-            {
-
-                break;
-            }
             case OP_EQ:
-            {
-
-                break;
-            }
             case OP_NEQ:
-            {
-
-                break;
-            }
             case OP_LT:
-            {
-
-                break;
-            }
             case OP_LE:
-            {
-
-                break;
-            }
             case OP_GT:
-            {
-
-                break;
-            }
             case OP_GE:
             {
-
-                break;
-            }
-            case OP_IS_NULL:
-            {
-
-                break;
-            }
-            case OP_TO_BOOL:
-            {
-
-                break;
-            }
-            case OP_TO_BOOL_N:
-            {
-
+                //libjit turns a comparison into a branch only when the branch follows it
+                if(insn->opcode >= OP_EQ && insn->opcode <= OP_GE && tvm_insn_jumps_next(end, insn) &&
+                   tvm_tier_threshold != 0 && data->tier == 0 && labels_placed[insn[1].index])
+                {
+                    tvm_function_emit_counter(function, data);
+                    counted = 1;
+                }
+
+                stack -= 2;
+                jit_value_t a = stack[0];
+                jit_value_t b = stack[1];
+
+                switch(insn->opcode)
+                {
+                    case OP_ADD: *stack = jit_insn_add(function, a, b); break;
+                    case OP_SUB: *stack = jit_insn_sub(function, a, b); break;
+                    case OP_MUL: *stack = jit_insn_mul(function, a, b); break;
+                    case OP_DIV: *stack = jit_insn_div(function, a, b); break;
+                    case OP_REM: *stack = jit_insn_rem(function, a, b); break;
+                    case OP_AND: *stack = jit_insn_and(function, a, b); break;
+                    case OP_OR: *stack = jit_insn_or(function, a, b); break;
+                    case OP_XOR: *stack = jit_insn_xor(function, a, b); break;
+                    case OP_SHL: *stack = jit_insn_shl(function, a, b); break;
+                    case OP_SHR: *stack = jit_insn_shr(function, a, b); break;
+                    case OP_EQ: *stack = jit_insn_eq(function, a, b); break;
+                    case OP_NEQ: *stack = jit_insn_ne(function, a, b); break;
+                    case OP_LT: *stack = jit_insn_lt(function, a, b); break;
+                    case OP_LE: *stack = jit_insn_le(function, a, b); break;
+                    case OP_GT: *stack = jit_insn_gt(function, a, b); break;
+                    case OP_GE: *stack = jit_insn_ge(function, a, b); break;
+                }
+                ++stack;
                 break;
             }
             case OP_JMP:
             {
-
+                if(tvm_tier_threshold != 0 && data->tier == 0 && labels_placed[insn->index])
+                    tvm_function_emit_counter(function, data);
+                jit_insn_branch(function, labels+insn->index);
                 break;
             }
             case OP_JMP_IF:
-            {
-
-                break;
-            }
             case OP_JMP_IF_N:
             {
+                if(!counted && tvm_tier_threshold != 0 && data->tier == 0 && labels_placed[insn->index])
+                    tvm_function_emit_counter(function, data);
+                --stack;
 
+                int if_not = (insn->opcode == OP_JMP_IF_N) != negated;
+                counted = 0;
+                negated = 0;
+
+                if(profiling)
+                    tvm_function_emit_site_count(function, data, site, if_not ? jit_insn_to_not_bool(function, *stack) : jit_insn_to_bool(function, *stack));
+                if(hottest != 0 && site < data->sites_num && data->site_counts[site][1] > data->site_counts[site][0])
+                {
+                    //mostly taken, the fall through code becomes a region out of line
+                    jit_label_t cold = jit_label_undefined;
+                    if(if_not)
+                        jit_insn_branch_if(function, *stack, &cold);
+                    else jit_insn_branch_if_not(function, *stack, &cold);
+                    jit_insn_branch(function, labels+insn->index);
+                    jit_insn_label(function, &cold);
+                    open_regions[open_num++] = cold;
+                }
+                else if(if_not)
+                    jit_insn_branch_if_not(function, *stack, labels+insn->index);
+                else jit_insn_branch_if(function, *stack, labels+insn->index);
+                ++site;
                 break;
             }
             case OP_LABEL:
             {
+                jit_ushort tmp = insn->index;
+                int cold_label = hottest != 0 && (jit_ulong)data->label_counts[tmp] * TVM_PGO_COLD_RATIO <= hottest;
 
-                break;
-            }
-            case OP_CAST_I8:
-            {
+                //regions moved away must not rely on fall through
+                if(open_num != 0 || cold_label)
+                    jit_insn_branch(function, labels+tmp);
 
-                break;
-            }
-            case OP_CAST_U8:
-            {
+                jit_insn_label(function, labels+tmp);
+                labels_placed[tmp] = 1;
 
-                break;
-            }
-            case OP_CAST_I16:
-            {
+                //a label closes the open regions, inner ones are moved first
+                while(open_num != 0)
+                {
+                    --open_num;
+                    moves_from[moves_num] = open_regions[open_num];
+                    moves_to[moves_num] = labels[tmp];
+                    ++moves_num;
+                }
 
-                break;
-            }
-            case OP_CAST_U16:
-            {
+                if(cold_label)
+                    open_regions[open_num++] = labels[tmp];
 
+                if(profiling)
+                    tvm_function_emit_increment(function, data->label_counts + tmp);
                 break;
             }
+            case OP_CAST_I8:
+            case OP_CAST_U8:
+            case OP_CAST_I16:
+            case OP_CAST_U16:
             case OP_CAST_I32:
-            {
-
-                break;
-            }
             case OP_CAST_U32:
-            {
-
-                break;
-            }
             case OP_CAST_I64:
-            {
-
-                break;
-            }
             case OP_CAST_U64:
-            {
-
-                break;
-            }
             case OP_CAST_F32:
-            {
-
-                break;
-            }
             case OP_CAST_F64:
-            {
-
-                break;
-            }
             case OP_CAST_VP:
-            {
-
-                break;
-            }
             case OP_CAST_PT:
-            {
-
-                break;
-            }
             case OP_CAST_ST:
-            {
-
-                break;
-            }
             case OP_CAST_E_ST:
-            {
-
-                break;
-            }
             case OP_CAST_T:
             {
-
+                --stack;
+                *stack = jit_insn_convert(function, *stack, insn->type, 0);
+                ++stack;
                 break;
             }
             case OP_ABORT:
             {
-                jit_type_t params_types[] = { jit_type_int };
-                jit_type_t sign = jit_type_create_signature(jit_abi_cdecl, jit_type_int, params_types, 1, 0);
                 --stack;
-                *stack = jit_insn_call_native(function, "abort", exit, sign, stack, EXIT_FAILURE, 0);
+                jit_insn_call_native(function, "exit", &exit, tvm_exit_signature, stack, 1, JIT_CALL_NORETURN);
                 break;
             }
             default:
-            fprintf(stderr, "VIRTUAL MACHINE FATAL ERROR!!! unrecognized opcode %x\n", *buf);
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "fatal VM error! unrecognized opcode %x in function %s.\n", insn->opcode, data->name);
+            result = JIT_RESULT_COMPILE_ERROR;
+        }
+
+        //replace a call with the body of the callee, its result is pushed at the current stack
+        if(inline_callee != NULL)
+        {
+            tvm_func_data_t callee_data = tvm_function_get_data(inline_callee);
+            inline_budget -= callee_data->insns_end - callee_data->insns;
+
+            frame.insn = insn;
+            frame.end = end;
+            frame.stack = stack;
+            frame.locals = locals;
+            frame.labels = labels;
+            frame.labels_placed = labels_placed;
+            frame.profiling = profiling;
+            frame.hottest = hottest;
+            frame.site = site;
+            frame.call_site = call_site;
+            frame.open_num = open_num;
+            frame.return_label = jit_label_undefined;
+            frame.guard_args = guard_args;
+            frame.guard_funcptr = guard_funcptr;
+            frame.guard_other = guard_other;
+
+            //arguments are converted as the call would do
+            jit_type_t signature = jit_function_get_signature(inline_callee);
+            unsigned int params_num = jit_type_num_params(signature);
+            args = jit_malloc((params_num + 1) * sizeof(jit_value_t));
+            unsigned int param;
+            for(param = 0; param < params_num; ++param)
+                args[param] = jit_insn_convert(function, inline_args[param], jit_type_get_param(signature, param), 0);
+
+            jit_type_t ret_type = jit_type_get_return(signature);
+            frame.result = jit_type_get_kind(ret_type) != JIT_TYPE_VOID ? jit_value_create(function, ret_type) : NULL;
+
+            locals = jit_malloc((callee_data->locals_num + 1) * sizeof(jit_value_t));
+            labels = jit_malloc((callee_data->labels_num + 1) * sizeof(jit_label_t));
+            labels_placed = jit_calloc(callee_data->labels_num + 1, sizeof(char));
+            for(i = 0; i < callee_data->labels_num; ++i)
+                labels[i] = jit_label_undefined;
+
+            //the profile and the cold regions belong to the caller
+            profiling = 0;
+            hottest = 0;
+            open_num = 0;
+
+            insn = callee_data->insns;
+            end = callee_data->insns_end;
+
+            inline_callee = NULL;
+            guard_args = NULL;
+            continue;
         }
+
+        ++insn;
+    }
+
+    //an error in an inlined body, the arrays of the caller are freed below
+    if(args != NULL)
+    {
+        jit_free(frame.guard_args);
+        jit_free(args);
+        jit_free(locals);
+        jit_free(labels);
+        jit_free(labels_placed);
+        locals = frame.locals;
+        labels = frame.labels;
+        labels_placed = frame.labels_placed;
+    }
+
+    //regions still open are already at the end
+    if(moves_num != 0 && result == JIT_RESULT_OK)
+    {
+        jit_insn_default_return(function);
+
+        for(i = 0; i < moves_num; ++i)
+            jit_insn_move_blocks_to_end(function, moves_from[i], moves_to[i]);
     }
 
     jit_free(stack_base);
     jit_free(locals);
+    jit_free(labels);
+    jit_free(labels_placed);
+    jit_free(open_regions);
+    jit_free(moves_from);
+    jit_free(moves_to);
+
+    if(tvm_stats_path)
+        data->build_ns = tvm_clock_ns() - begin;
 
-    return JIT_RESULT_OK;
+    return result;
 }
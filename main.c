@@ -1,7 +1,23 @@
 #include "tvm.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <jit/jit-dump.h>
+
+/*Print the eager compilation time of each function to stderr*/
+static void print_compile_report
+    (tvm_module_t module)
+{
+    char* name = module->name ? module->name : "<main>";
+    tvm_func_data_t data = tvm_function_get_data(module->start);
+
+    fprintf(stderr, "%-24s %-32s %12.3f ms\n", name, data->name, data->compile_ns / 1e6);
+
+    int i;
+    for(i = 0; i < module->funcs_len; ++i)
+    {
+        data = tvm_function_get_data(module->funcs[i]);
+        fprintf(stderr, "%-24s %-32s %12.3f ms\n", name, data->name, data->compile_ns / 1e6);
+    }
+}
 
 int main
     (int argc, char**  argv)
@@ -11,25 +27,48 @@ int main
     if(argc < 2)
         return EXIT_FAILURE;
     
-    FILE* input = fopen(argv[1], "rb");
-    
-    fseek(input, 0, SEEK_END);
-    long input_size = ftell(input);
-    rewind(input);
-    
-    char* input_content = jit_malloc(input_size);
-    
-    long k;
-    for(k = 0; k < input_size; ++k)
-        input_content[k] = fgetc(input);
+    jit_ulong load_begin = tvm_clock_ns();
+
+    unsigned char* input_end;
+    unsigned char* input_content = tvm_bytecode_load(argv[1], &input_end);
+
+    if(input_content == NULL)
+    {
+        fprintf(stderr, "fatal VM error! unable to load %s.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
     
-    tvm_program_t prog = tvm_program_create(input_content, input_content+input_size);
+    tvm_program_t prog = tvm_program_create(input_content, input_end);
+
+    if(tvm_stats_path)
+        prog->start->load_ns = tvm_clock_ns() - load_begin;
     
     jit_context_build_start(prog->context);
     tvm_program_build(prog);
     jit_context_build_end(prog->context);
     
-    tvm_program_run(prog, argc -1, argv +1);
+    if(tvm_eager)
+    {
+        jit_ulong compile_ns = tvm_program_compile(prog);
+
+        if(tvm_program_eager_module(prog, prog->start))
+            print_compile_report(prog->start);
+
+        int i;
+        for(i = 0; i < prog->modules->allocd; ++i)
+            if(prog->modules->hashcodes[i] != 0 && tvm_program_eager_module(prog, prog->modules->data[i]))
+                print_compile_report(prog->modules->data[i]);
+
+        fprintf(stderr, "total compile time %.3f ms\n", compile_ns / 1e6);
+    }
+    
+    //libraries start entries are compiled on demand, so outside the build lock
+    tvm_program_init(prog);
     
-    jit_dump_function(stdout, prog->start->start, "<start>");
+    int ret = tvm_program_run(prog, argc -1, argv +1);
+
+    if(tvm_stats_path && tvm_program_write_stats(prog, tvm_stats_path) != 0)
+        fprintf(stderr, "VM warning! unable to write stats to %s.\n", tvm_stats_path);
+
+    return ret;
 }
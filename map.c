@@ -1,20 +1,121 @@
+/*
+ * map.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
 #include "tvm.h"
 
-int hash_function
+/*Minimum number of slots of a map*/
+#define TVM_MAP_MIN_SLOTS 8
+
+/*Grow when count/allocd would exceed 3/4*/
+#define tvm_map_is_full(map) \
+    (((map)->count + 1) * 4 > (map)->allocd * 3)
+
+/*FNV-1a, 0 is reserved to mark empty slots*/
+static jit_uint hash_function
     (char* key)
 {
-    return jit_strlen(key);//TODO CRC hash
+    jit_uint hash = 2166136261u;
+    while(*key)
+    {
+        hash ^= (unsigned char)*(key++);
+        hash *= 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+/*Alloc slots arrays, allocd must be a power of 2*/
+static void tvm_map_alloc_slots
+    (tvm_map_t map, int allocd)
+{
+    map->hashcodes = jit_calloc(allocd, sizeof(jit_uint));
+    map->keys = jit_malloc(sizeof(char*) * allocd);
+    map->data = jit_malloc(sizeof(void*) * allocd);
+    map->allocd = allocd;
+}
+
+/*Linear probing on the hashcodes array, returns the slot of key or the first empty one*/
+static int tvm_map_find_slot
+    (tvm_map_t map, char* key, jit_uint hash)
+{
+    int mask = map->allocd - 1;
+    int i = hash & mask;
+    while(map->hashcodes[i] != 0)
+    {
+        if(map->hashcodes[i] == hash && jit_strcmp(map->keys[i], key) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void tvm_map_grow
+    (tvm_map_t map)
+{
+    jit_uint* old_hashcodes = map->hashcodes;
+    char** old_keys = map->keys;
+    void** old_data = map->data;
+    int old_allocd = map->allocd;
+
+    tvm_map_alloc_slots(map, old_allocd * 2);
+
+    //reinsert old entries, keys are unique so only empty slots are searched
+    int mask = map->allocd - 1;
+    int i;
+    for(i = 0; i < old_allocd; ++i)
+    {
+        if(old_hashcodes[i] == 0)
+            continue;
+
+        int j = old_hashcodes[i] & mask;
+        while(map->hashcodes[j] != 0)
+            j = (j + 1) & mask;
+
+        map->hashcodes[j] = old_hashcodes[i];
+        map->keys[j] = old_keys[i];
+        map->data[j] = old_data[i];
+    }
+
+    jit_free(old_hashcodes);
+    jit_free(old_keys);
+    jit_free(old_data);
 }
 
 tvm_map_t tvm_map_create
     (int initial_size)
 {
     tvm_map_t map = jit_malloc(sizeof(struct _tvm_map));
-    map->hashcodes = jit_malloc(sizeof(int) * initial_size);
-    map->keys = jit_malloc(sizeof(char*) * initial_size);
-    map->data = jit_malloc(sizeof(void*) * initial_size);
+
+    //round up to a power of 2 able to keep initial_size elements under the load factor
+    int allocd = TVM_MAP_MIN_SLOTS;
+    while(allocd * 3 < initial_size * 4)
+        allocd *= 2;
+
+    tvm_map_alloc_slots(map, allocd);
     map->count = 0;
-    map->allocd = initial_size;
+
+    return map;
 }
 
 void tvm_map_free
@@ -29,37 +130,27 @@ void tvm_map_free
 void tvm_map_add
     (tvm_map_t map, char* key, void* data)
 {
-    int hash = hash_function(key);
-    int last = map->count;
+    if(tvm_map_is_full(map))
+        tvm_map_grow(map);
+
+    jit_uint hash = hash_function(key);
+    int i = tvm_map_find_slot(map, key, hash);
+
+    //a duplicate key keeps its first value
+    if(map->hashcodes[i] != 0)
+        return;
+
+    map->hashcodes[i] = hash;
+    map->keys[i] = key;
+    map->data[i] = data;
     ++map->count;
-    if(map->count > map->allocd)
-    {
-        map->allocd += map->allocd;
-        map->hashcodes = jit_realloc(map->hashcodes, sizeof(int) * map->allocd);
-        map->keys = jit_realloc(map->keys, sizeof(char*) * map->allocd);
-        map->data = jit_realloc(map->data, sizeof(void*) * map->allocd);
-    }
-    map->hashcodes[last] = hash;
-    map->keys[last] = key;
-    map->data[last] = data;
 }
 
 void* tvm_map_get
     (tvm_map_t map, char* key)
 {
-    void* elem = NULL;
-    int hash = hash_function(key);
-    int i;
-    for(i = 0; i < map->count; ++i)
-    {
-        if(map->hashcodes[i] == hash)
-        {
-            if(jit_strcmp(map->keys[i], key) == 0)
-            {
-                elem = map->data[i];
-                break;
-            }
-        }
-    }
-    return elem;
+    int i = tvm_map_find_slot(map, key, hash_function(key));
+    if(map->hashcodes[i] == 0)
+        return NULL;
+    return map->data[i];
 }
@@ -28,13 +28,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 /*Read an ushort and get a struct by index from a module*/
 #define tvm_module_get_struct_type(module, buf) \
-    jit_type_copy(((module)->structs+(int)tvm_ushort_from_bytes(buf))->type)
+    (((module)->structs+(int)tvm_ushort_from_bytes(buf))->type)
 
 /*Read an ushort and get an external struct by index from a module*/
 #define tvm_module_get_ext_struct_type(module, buf) \
-    jit_type_copy((*((module)->ext_structs+(int)tvm_ushort_from_bytes(buf)))->type)
+    ((*((module)->ext_structs+(int)tvm_ushort_from_bytes(buf)))->type)
 
 jit_type_t tvm_module_get_type
     (tvm_module_t module, unsigned char** buf)
@@ -63,17 +70,89 @@ jit_type_t tvm_module_get_type
 #define DIR_SEP "/"
 #endif
 
-void tvm_module_build
+unsigned char* tvm_bytecode_load
+    (const char* path, unsigned char** bytecode_end)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    //private read-only mapping, pages are shared through the page cache
+    unsigned char* bytecode = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    //the mapping holds its own reference to the file
+    close(fd);
+
+    if(bytecode == MAP_FAILED)
+        return NULL;
+
+    *bytecode_end = bytecode + st.st_size;
+    return bytecode;
+#else
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    rewind(fp);
+
+    unsigned char* bytecode = jit_malloc(file_size);
+    if(fread(bytecode, 1, file_size, fp) != (size_t)file_size)
+    {
+        jit_free(bytecode);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+
+    *bytecode_end = bytecode + file_size;
+    return bytecode;
+#endif
+}
+
+void tvm_bytecode_unload
+    (unsigned char* bytecode, unsigned char* bytecode_end)
+{
+#ifndef _WIN32
+    munmap(bytecode, bytecode_end - bytecode);
+#else
+    jit_free(bytecode);
+#endif
+}
+
+void tvm_module_parse
     (tvm_module_t module)
 {
     unsigned char* buf = module->bytecode;
 
+    jit_ulong begin = tvm_stats_path ? tvm_clock_ns() : 0;
+
     //remove header if present
     if(module->bytecode_end >= buf + 22 && jit_strncmp(buf, "#!/usr/bin/env tripel\n", 22) == 0)
         buf += 22;
 
+    //check the magic and the format version
+    if(module->bytecode_end < buf + TVM_MODULE_MAGIC_LEN + 1 ||
+        jit_memcmp(buf, TVM_MODULE_MAGIC, TVM_MODULE_MAGIC_LEN) != 0 ||
+        buf[TVM_MODULE_MAGIC_LEN] != TVM_MODULE_VERSION)
+    {
+        fprintf(stderr, "fatal VM error! module %s is not a Tripel module of format version %d.\n",
+            module->name ? module->name : "<main>", TVM_MODULE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    buf += TVM_MODULE_MAGIC_LEN + 1;
+
     char* name;
-    size_t name_len;
     int i, j;
 
     //read the number of string constants
@@ -131,25 +210,26 @@ void tvm_module_build
             fields_types[j] = tvm_module_get_type(module, &buf);
         }
 
-        //create struct type
-        module->structs[i].type = jit_type_create_struct(fields_types, fields_num, 0);
+        //get struct type, structs with the same fields types share it
+        module->structs[i].type = tvm_program_struct_type(module->program, fields_types, fields_num);
         module->structs[i].fields_names = fields_names;
+        module->structs[i].descr = tvm_type_gc_descr(module->structs[i].type);
 
         tvm_map_add(module->structs_map, name, module->structs+i);
 
         //free types array
         jit_free(fields_types);
     }
-printf(" globals %X\n", buf-module->bytecode);
     //read the number of global vars
     num = tvm_ushort_from_bytes(buf);
 
-    //alloc globals vars container and add it to garbage collector roots
+    //alloc globals vars container
     module->globals = jit_malloc(sizeof(tvm_global_var_t) * num);
-    //GC_add_roots(module->globals_pool, sizeof(struct _tvm_global_var) * num);
     module->globals_len = num;
     module->globals_map = tvm_map_create(num);
 
+    //globals are laid out in declaration order, offsets are stored in data until the segment exists
+    jit_nuint globals_size = 0;
     for(i = 0; i < num; ++i)
     {
         name = buf;
@@ -158,17 +238,29 @@ printf(" globals %X\n", buf-module->bytecode);
 
         jit_type_t type = tvm_module_get_type(module, &buf);
 
-        //gc alloc global var space and set to 0
-        size_t type_size = jit_type_get_size(type);
-        module->globals[i].data = GC_MALLOC(type_size);
-        jit_memset(module->globals[i].data, 0, type_size);
+        jit_nuint align = jit_type_get_alignment(type);
+        globals_size = (globals_size + align - 1) & ~(align - 1);
+        module->globals[i].data = (void*)globals_size;
+        globals_size += jit_type_get_size(type);
 
         //set pointer type
-        module->globals[i].type = jit_type_create_pointer(type, 0);
+        module->globals[i].type = tvm_program_pointer_type(module->program, type);
 
         tvm_map_add(module->globals_map, name, module->globals+i);
     }
 
+    //one zeroed segment for all the globals, scanned by the garbage collector as a single root
+    module->globals_segment = NULL;
+    module->globals_size = globals_size;
+    if(globals_size != 0)
+    {
+        module->globals_segment = jit_calloc(1, globals_size);
+        GC_add_roots(module->globals_segment, (char*)module->globals_segment + globals_size);
+    }
+
+    for(i = 0; i < num; ++i)
+        module->globals[i].data = (char*)module->globals_segment + (jit_nuint)module->globals[i].data;
+
     //read the number of native function pointers
     num = tvm_ushort_from_bytes(buf);
 
@@ -176,6 +268,8 @@ printf(" globals %X\n", buf-module->bytecode);
     module->c_funcs_len = num;
     module->c_funcs_map = tvm_map_create(num);
 
+    tvm_funcptr_t* c_funcs_it = module->c_funcs;
+
     //read the number of native libraries
     jit_ushort libs_num = tvm_ushort_from_bytes(buf);
 
@@ -215,6 +309,12 @@ printf(" globals %X\n", buf-module->bytecode);
                 exit(EXIT_FAILURE);
             }
 
+            if(c_funcs_it == module->c_funcs + module->c_funcs_len)
+            {
+                fprintf(stderr, "fatal VM error! native functions exceed the declared number.\n");
+                exit(EXIT_FAILURE);
+            }
+
             jit_type_t ret_type = tvm_module_get_type(module, &buf);
 
             //read parameters number
@@ -227,11 +327,21 @@ printf(" globals %X\n", buf-module->bytecode);
             for(k = 0; k < params_num; ++k)
                 params[k] = tvm_module_get_type(module, &buf);
 
-            //fill funcptr record at index i in the module
-            module->c_funcs[i].signature = jit_type_create_signature(jit_abi_cdecl, ret_type, params, params_num, 0);
-            module->c_funcs[i].functor = functor;
+            //read attributes
+            int attributes = *(buf++);
 
-            tvm_map_add(module->c_funcs_map, fname, module->c_funcs+i);
+            //fill the next funcptr record in the module
+            c_funcs_it->signature = tvm_program_signature_type(module->program, ret_type, params, params_num);
+            c_funcs_it->functor = functor;
+            c_funcs_it->attributes = attributes;
+            c_funcs_it->call_flags = 0;
+            if(attributes & TVM_NATIVE_NOTHROW)
+                c_funcs_it->call_flags |= JIT_CALL_NOTHROW;
+            if(attributes & TVM_NATIVE_NORETURN)
+                c_funcs_it->call_flags |= JIT_CALL_NORETURN;
+
+            tvm_map_add(module->c_funcs_map, fname, c_funcs_it);
+            ++c_funcs_it;
 
             jit_free(params);
         }
@@ -281,8 +391,9 @@ printf(" globals %X\n", buf-module->bytecode);
         for(k = 0; k < params_num; ++k)
             params[k] = tvm_module_get_type(module, &buf);
 
-        //create signature
-        jit_type_t signature = jit_type_create_signature(jit_abi_cdecl, ret_type, params, params_num, 0);
+        //get signature
+        jit_type_t signature = tvm_program_signature_type(module->program, ret_type, params, params_num);
+        jit_free(params);
 
         //get properties
         stack_len = tvm_ushort_from_bytes(buf);
@@ -313,72 +424,150 @@ printf(" globals %X\n", buf-module->bytecode);
     module->ext_c_funcs = jit_malloc(sizeof(void*) * module->ext_c_funcs_len);
     module->ext_funcs = jit_malloc(sizeof(void*) * module->ext_funcs_len);
 
-    //iterators
-    tvm_struct_t** ext_structs_it = module->ext_structs;
-    tvm_global_var_t** ext_globals_it = module->ext_globals;
-    tvm_funcptr_t** ext_c_funcs_it = module->ext_c_funcs;
-    jit_function_t** ext_funcs_it = module->ext_funcs;
+    //libraries are loaded and linked later
+    module->imports = buf;
 
-    //read the number of libraries
-    num = tvm_ushort_from_bytes(buf);
+    if(tvm_stats_path)
+        module->parse_ns = tvm_clock_ns() - begin;
+}
 
-    for(i = 0; i < num; ++i)
+/*Load <name>.tripel from the working directory or from the libpath*/
+static unsigned char* tvm_module_load_lib
+    (char* name, unsigned char** lib_end)
+{
+    size_t name_len = jit_strlen(name);
+
+    //room for ".tripel", the separator and NUL
+    char * path = jit_malloc(tvm_libpath_len + name_len + 9);
+
+    jit_memcpy(path, name, name_len);
+    jit_memcpy(path + name_len, ".tripel", 8);
+
+    unsigned char* lib_bytecode = tvm_bytecode_load(path, lib_end);
+
+    if(lib_bytecode == NULL && tvm_libpath_len != 0)
     {
-        name = buf;
+        //retry in <libpath>/<name>.tripel
+        jit_memmove(path + tvm_libpath_len + 1, path, name_len + 8);
+        jit_memcpy(path, tvm_libpath, tvm_libpath_len);
+        path[tvm_libpath_len] = DIR_SEP[0];
 
-        while(*buf)
-            ++buf;
-        ++buf;
+        lib_bytecode = tvm_bytecode_load(path, lib_end);
+    }
 
-        name_len = (char*)buf - name;
+    if(lib_bytecode == NULL)
+    {
+        fprintf(stderr, "fatal VM error! library %s not found.\n", name);
+        exit(EXIT_FAILURE);
+    }
 
-        tvm_module_t lib = tvm_program_find_module(module->program, name);
+    jit_free(path);
 
-        //if the module is not found load it
-        if(lib == NULL)
-        {
-            char * path = jit_malloc(tvm_libpath_len + name_len + 5);
+    return lib_bytecode;
+}
 
-            jit_memcpy(path, name, name_len);
-            jit_memcpy(path + name_len, ".tripel", 8);
+/*Skip a list of symbol names preceded by their number*/
+#define tvm_skip_names(buf) \
+do { \
+    jit_ushort names_num = tvm_ushort_from_bytes(buf); \
+    while(names_num--) \
+        while(*(buf++)) ; \
+} while(0)
 
-            FILE * fp = fopen(path, "r");
+struct _tvm_load_job
+{
+    tvm_module_t module;
+    tvm_pool_t pool;
+};
 
-            if(fp == NULL)
-            {
-                jit_memmove(path + tvm_libpath_len, path, name_len + 5);
-                jit_memcpy(path, tvm_libpath, tvm_libpath_len);
+static void tvm_module_discover
+    (tvm_module_t module, tvm_pool_t pool);
 
-                fp = fopen(path, "r");
+/*Pool job: read and parse a registered library and discover its imports*/
+static void tvm_module_load_job
+    (void* arg)
+{
+    struct _tvm_load_job* job = arg;
+    tvm_module_t lib = job->module;
 
-                if(fp == NULL)
-                {
-                    fprintf(stderr, "fatal VM error! library %s not found.\n", name);
-                    exit(EXIT_FAILURE);
-                }
-            }
+    jit_ulong begin = tvm_stats_path ? tvm_clock_ns() : 0;
 
-            fseek(fp, 0, SEEK_END);
-            long file_size = ftell(fp);
-            rewind(fp);
+    lib->bytecode = tvm_module_load_lib(lib->name, &lib->bytecode_end);
 
-            unsigned char* file_content = jit_malloc(file_size);
+    if(tvm_stats_path)
+        lib->load_ns = tvm_clock_ns() - begin;
+
+    tvm_module_parse(lib);
+
+    tvm_module_discover(lib, job->pool);
+
+    jit_free(job);
+}
 
-            long k;
-            for(k = 0; k < file_size; ++k)
-                file_content[k] = fgetc(fp);
+/*Register the libraries imported by a parsed module and queue the new ones*/
+static void tvm_module_discover
+    (tvm_module_t module, tvm_pool_t pool)
+{
+    unsigned char* buf = module->imports;
 
-            jit_free(path);
+    jit_ushort num = tvm_ushort_from_bytes(buf);
 
-            lib = tvm_module_create_build(module->program, file_content, file_content + file_size);
+    int i;
+    for(i = 0; i < num; ++i)
+    {
+        char* name = buf;
+        while(*(buf++)) ;
 
-            //add the module to the program
-            tvm_map_add(module->program->modules, name, lib);
+        int created;
+        tvm_module_t lib = tvm_program_find_add_module(module->program, name, &created);
 
-            //call the start entry of the module
-            ((int (*)())jit_function_to_closure(lib->start))();
+        if(created)
+        {
+            struct _tvm_load_job* job = jit_malloc(sizeof(struct _tvm_load_job));
+            job->module = lib;
+            job->pool = pool;
+            tvm_pool_submit(pool, &tvm_module_load_job, job);
         }
 
+        //skip imported structs, globals, native functions and functions names
+        tvm_skip_names(buf);
+        tvm_skip_names(buf);
+        tvm_skip_names(buf);
+        tvm_skip_names(buf);
+    }
+}
+
+void tvm_module_link
+    (tvm_module_t module)
+{
+    if(module->libs != NULL)
+        return;
+
+    unsigned char* buf = module->imports;
+    char* name;
+    int i, j;
+
+    //iterators
+    tvm_struct_t** ext_structs_it = module->ext_structs;
+    tvm_global_var_t** ext_globals_it = module->ext_globals;
+    tvm_funcptr_t** ext_c_funcs_it = module->ext_c_funcs;
+    jit_function_t** ext_funcs_it = module->ext_funcs;
+
+    //read the number of libraries
+    jit_ushort num = tvm_ushort_from_bytes(buf);
+
+    //the array is never empty so it also marks the module as linked
+    module->libs = jit_malloc(sizeof(tvm_module_t) * (num + 1));
+    module->libs_len = num;
+
+    for(i = 0; i < num; ++i)
+    {
+        name = buf;
+        while(*(buf++)) ;
+
+        tvm_module_t lib = tvm_program_find_module(module->program, name);
+        module->libs[i] = lib;
+
         //read the number of structure definitions to import from the lib
         jit_ushort l_num = tvm_ushort_from_bytes(buf);
 
@@ -434,6 +623,41 @@ printf(" globals %X\n", buf-module->bytecode);
 
     }
 
+    //imports are resolved, decode and check all the function bodies
+    tvm_function_verify(module->start);
+    tvm_function_escape_analysis(module->start);
+    for(i = 0; i < module->funcs_len; ++i)
+    {
+        tvm_function_verify(module->funcs[i]);
+        tvm_function_escape_analysis(module->funcs[i]);
+    }
+
+    //link the libraries after the module so cycles terminate
+    for(i = 0; i < num; ++i)
+        tvm_module_link(module->libs[i]);
+}
+
+void tvm_module_build
+    (tvm_module_t module)
+{
+    tvm_module_parse(module);
+
+    //read the number of libraries
+    unsigned char* buf = module->imports;
+    jit_ushort libs_num = tvm_ushort_from_bytes(buf);
+
+    if(libs_num != 0)
+    {
+        //the whole import graph is read and parsed on the pool
+        tvm_pool_t pool = tvm_pool_create(tvm_load_threads);
+
+        tvm_module_discover(module, pool);
+
+        tvm_pool_wait(pool);
+        tvm_pool_free(pool);
+    }
+
+    tvm_module_link(module);
 }
 
 tvm_module_t tvm_module_create
@@ -442,26 +666,53 @@ tvm_module_t tvm_module_create
     tvm_module_t module = jit_malloc(sizeof(struct _tvm_module));
 
     module->program = program;
+    module->name = NULL;
     module->bytecode = bytecode;
     module->bytecode_end = bytecode_end;
 
+    module->imports = NULL;
+    module->libs = NULL;
+    module->libs_len = 0;
+    module->initialized = 0;
+
+    module->load_ns = 0;
+    module->parse_ns = 0;
+
     return module;
 }
 
 tvm_module_t tvm_module_create_build
     (tvm_program_t program, unsigned char *bytecode, unsigned char *bytecode_end)
 {
-    tvm_module_t module = jit_malloc(sizeof(struct _tvm_module));
-
-    module->program = program;
-    module->bytecode = bytecode;
-    module->bytecode_end = bytecode_end;
+    tvm_module_t module = tvm_module_create(program, bytecode, bytecode_end);
 
     tvm_module_build(module);
 
     return module;
 }
 
+void tvm_module_compile
+    (tvm_module_t module)
+{
+    tvm_function_compile(module->start);
+
+    int i;
+    for(i = 0; i < module->funcs_len; ++i)
+        tvm_function_compile(module->funcs[i]);
+}
+
+int tvm_module_get_native
+    (tvm_module_t module, char* name, tvm_native_func_t* func)
+{
+    jit_function_t* function = tvm_map_get(module->funcs_map, name);
+    if(function == NULL)
+        return 0;
+
+    func->entry = tvm_function_native_entry(*function);
+    func->signature = jit_function_get_signature(*function);
+    return func->entry != NULL;
+}
+
 void tvm_module_free
     (tvm_module_t module)
 {
@@ -469,29 +720,31 @@ void tvm_module_free
 
     jit_free(module->funcs);
 
+    //types are interned and freed with the program
     int i;
     for(i = 0; i < module->structs_len; ++i)
-        jit_type_free(module->structs[i].type);
+        jit_free(module->structs[i].fields_names);
 
     jit_free(module->structs);
 
-    for(i = 0; i < module->globals_len; ++i)
+    if(module->globals_segment != NULL)
     {
-        //tells GC to free global data
-        GC_free(module->globals[i].data);
-
-        jit_type_free(module->globals[i].type);
+        GC_remove_roots(module->globals_segment, (char*)module->globals_segment + module->globals_size);
+        jit_free(module->globals_segment);
     }
 
-    //GC_remove_roots(module->globals, sizeof(struct _tvm_global_var) * num);
-
     jit_free(module->globals);
 
     jit_free(module->strings);
 
     //free arrays of lib elements
+    jit_free(module->ext_structs);
+    jit_free(module->ext_globals);
+    jit_free(module->ext_c_funcs);
+    jit_free(module->ext_funcs);
+    jit_free(module->libs);
 
-    jit_free(module->bytecode);
+    tvm_bytecode_unload(module->bytecode, module->bytecode_end);
 
     tvm_map_free(module->structs_map);
     tvm_map_free(module->globals_map);
@@ -0,0 +1,156 @@
+/*
+ * pool.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+#include <unistd.h>
+
+/*Job in the pool queue*/
+struct _tvm_pool_job
+{
+    tvm_pool_func_t func;
+    void* arg;
+    struct _tvm_pool_job* next;
+};
+
+/*Worker loop, threads are created through the GC pthread redirect so they are registered*/
+static void* tvm_pool_worker
+    (void* arg)
+{
+    tvm_pool_t pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(pool->first == NULL && !pool->stop)
+            pthread_cond_wait(&pool->jobs_cond, &pool->lock);
+
+        if(pool->first == NULL)
+            break;
+
+        struct _tvm_pool_job* job = pool->first;
+        pool->first = job->next;
+        if(pool->first == NULL)
+            pool->last = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+
+        job->func(job->arg);
+        jit_free(job);
+
+        pthread_mutex_lock(&pool->lock);
+
+        --pool->pending;
+        if(pool->pending == 0)
+            pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int tvm_pool_default_threads
+    (void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+tvm_pool_t tvm_pool_create
+    (int threads_num)
+{
+    tvm_pool_t pool = jit_malloc(sizeof(struct _tvm_pool));
+
+    if(threads_num <= 0)
+        threads_num = tvm_pool_default_threads();
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->jobs_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->first = NULL;
+    pool->last = NULL;
+    pool->pending = 0;
+    pool->stop = 0;
+
+    pool->threads = jit_malloc(sizeof(pthread_t) * threads_num);
+    pool->threads_num = threads_num;
+
+    int i;
+    for(i = 0; i < threads_num; ++i)
+        pthread_create(pool->threads + i, NULL, &tvm_pool_worker, pool);
+
+    return pool;
+}
+
+void tvm_pool_submit
+    (tvm_pool_t pool, tvm_pool_func_t func, void* arg)
+{
+    struct _tvm_pool_job* job = jit_malloc(sizeof(struct _tvm_pool_job));
+    job->func = func;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if(pool->last)
+        pool->last->next = job;
+    else
+        pool->first = job;
+    pool->last = job;
+
+    ++pool->pending;
+
+    pthread_cond_signal(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tvm_pool_wait
+    (tvm_pool_t pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending != 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tvm_pool_free
+    (tvm_pool_t pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for(i = 0; i < pool->threads_num; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->jobs_cond);
+    pthread_cond_destroy(&pool->done_cond);
+
+    jit_free(pool->threads);
+    jit_free(pool);
+}
@@ -24,19 +24,51 @@
  */
 
 #include "tvm.h"
+#include <time.h>
 
 /**** exported globals var ****/
 jit_type_t tvm_start_signature;
 jit_type_t tvm_gc_malloc_signature;
+jit_type_t tvm_promote_signature;
+jit_type_t tvm_exit_signature;
+jit_type_t tvm_profile_call_signature;
+jit_type_t tvm_gc_cache_signature;
+jit_type_t tvm_gc_refill_signature;
+jit_type_t tvm_gc_typed_malloc_signature;
+jit_type_t tvm_gc_typed_calloc_signature;
+jit_type_t tvm_thread_spawn_signature;
+jit_type_t tvm_thread_join_signature;
 
 jit_type_t tvm_type_string;
 
 char* tvm_libpath;
 size_t tvm_libpath_len;
 
+int tvm_load_threads;
+int tvm_eager;
+char* tvm_eager_modules;
+jit_uint tvm_tier_threshold;
+int tvm_pgo;
+int tvm_inline_limit;
+char* tvm_stats_path;
+
+jit_nuint tvm_gc_divisor;
+jit_nuint tvm_gc_initial_heap;
+int tvm_gc_incremental;
+jit_uint tvm_gc_pause_ms;
+
 jit_type_t* tvm_types_table;
 /******************************/
 
+jit_ulong tvm_clock_ns
+    (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (jit_ulong)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
 tvm_program_t tvm_program_create
     (unsigned char* bytecode, unsigned char* bytecode_end)
 {
@@ -44,8 +76,16 @@ tvm_program_t tvm_program_create
 
     program->context = jit_context_create();
 
+    //the memory manager must be set before the first function is created
+    if(tvm_stats_path)
+        tvm_stats_setup(program->context);
+
     //alloc the modules map with a start size of 16 elements
     program->modules = tvm_map_create(16);
+    program->types = tvm_map_create(64);
+    program->types_requested = 0;
+    program->types_created = 0;
+    pthread_mutex_init(&program->lock, NULL);
 
     program->start = tvm_module_create(program, bytecode, bytecode_end);
 
@@ -56,22 +96,126 @@ tvm_program_t tvm_program_create
 tvm_program_t tvm_program_create_build
     (unsigned char* bytecode, unsigned char* bytecode_end)
 {
-    tvm_program_t program = jit_malloc(sizeof(struct _tvm_program));
+    tvm_program_t program = tvm_program_create(bytecode, bytecode_end);
 
-    program->context = jit_context_create();
+    tvm_program_build(program);
 
-    //alloc the modules map with a start size of 16 elements
-    program->modules = tvm_map_create(16);
+    return program;
+}
 
-    program->start = tvm_module_create_build(program, bytecode, bytecode_end);
 
-    return program;
+tvm_module_t tvm_program_find_module
+    (tvm_program_t program, char* name)
+{
+    pthread_mutex_lock(&program->lock);
+    tvm_module_t module = tvm_map_get(program->modules, name);
+    pthread_mutex_unlock(&program->lock);
+
+    return module;
+}
+
+
+tvm_module_t tvm_program_find_add_module
+    (tvm_program_t program, char* name, int* created)
+{
+    pthread_mutex_lock(&program->lock);
+
+    tvm_module_t module = tvm_map_get(program->modules, name);
+    *created = module == NULL;
+
+    if(module == NULL)
+    {
+        //the bytecode is set by the loader that owns the new module
+        module = tvm_module_create(program, NULL, NULL);
+        module->name = name;
+
+        tvm_map_add(program->modules, name, module);
+    }
+
+    pthread_mutex_unlock(&program->lock);
+
+    return module;
+}
+
+
+int tvm_program_eager_module
+    (tvm_program_t program, tvm_module_t module)
+{
+    if(tvm_eager_modules == NULL)
+        return 1;
+
+    char* name = module == program->start ? "<main>" : module->name;
+    size_t len = jit_strlen(name);
+
+    char* it = tvm_eager_modules;
+    while(*it)
+    {
+        char* comma = it;
+        while(*comma && *comma != ',')
+            ++comma;
+
+        if((size_t)(comma - it) == len && jit_strncmp(it, name, len) == 0)
+            return 1;
+
+        it = *comma ? comma + 1 : comma;
+    }
+
+    return 0;
+}
+
+jit_ulong tvm_program_compile
+    (tvm_program_t program)
+{
+    jit_ulong begin = tvm_clock_ns();
+
+    if(tvm_program_eager_module(program, program->start))
+        tvm_module_compile(program->start);
+
+    int i;
+    for(i = 0; i < program->modules->allocd; ++i)
+        if(program->modules->hashcodes[i] != 0 && tvm_program_eager_module(program, program->modules->data[i]))
+            tvm_module_compile(program->modules->data[i]);
+
+    return tvm_clock_ns() - begin;
+}
+
+
+/*Post order visit of the imports graph*/
+static void tvm_module_init
+    (tvm_module_t module)
+{
+    if(module->initialized)
+        return;
+
+    //mark before the visit so cycles terminate
+    module->initialized = 1;
+
+    int i;
+    for(i = 0; i < module->libs_len; ++i)
+        tvm_module_init(module->libs[i]);
+
+    //the start entry of the start module is the program entry point
+    if(module != module->program->start)
+        ((int (*)())jit_function_to_closure(module->start))();
+}
+
+
+void tvm_program_init
+    (tvm_program_t program)
+{
+    tvm_module_init(program->start);
 }
 
 
 void tvm_program_free
     (tvm_program_t program)
 {
+    //free libraries
+    int i;
+    for(i = 0; i < program->modules->allocd; ++i)
+        if(program->modules->hashcodes[i] != 0)
+            tvm_module_free(program->modules->data[i]);
+
     //free modules map
     tvm_map_free(program->modules);
 
@@ -81,5 +225,10 @@ void tvm_program_free
     //destroy jit context
     jit_context_destroy(program->context);
 
+    //functions signatures are released with the context
+    tvm_program_types_free(program);
+
+    pthread_mutex_destroy(&program->lock);
+
     jit_free(program);
 }
@@ -0,0 +1,196 @@
+/*
+ * stats.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+#include <jit/jit-memory.h>
+#include <stdio.h>
+
+/*
+The generated code size is not exposed by libjit, the default memory manager
+is wrapped to read the code break around each function.
+Functions are generated one at a time per context (build lock) so a single
+current function is enough.
+*/
+static jit_memory_manager_t tvm_stats_default_manager;
+static struct jit_memory_manager tvm_stats_manager;
+
+static jit_function_t tvm_stats_current;
+static unsigned char* tvm_stats_code_start;
+
+//code generation restarts when the buffer is full, the time of each attempt is summed
+static jit_ulong tvm_stats_codegen_begin;
+static jit_ulong tvm_stats_codegen_ns;
+
+static int tvm_stats_start_function
+    (jit_memory_context_t memctx, jit_function_t func)
+{
+    int result = tvm_stats_default_manager->start_function(memctx, func);
+
+    tvm_stats_current = func;
+    tvm_stats_code_start = tvm_stats_default_manager->get_break(memctx);
+    tvm_stats_codegen_begin = tvm_clock_ns();
+
+    return result;
+}
+
+static int tvm_stats_end_function
+    (jit_memory_context_t memctx, int result)
+{
+    tvm_stats_codegen_ns += tvm_clock_ns() - tvm_stats_codegen_begin;
+
+    //the break is the end of the code when the generation succeeded
+    if(result == JIT_MEMORY_OK && tvm_stats_current != NULL)
+    {
+        tvm_func_data_t data = tvm_function_get_data(tvm_stats_current);
+        if(data != NULL)
+        {
+            unsigned char* code_end = tvm_stats_default_manager->get_break(memctx);
+            data->code_size = code_end - tvm_stats_code_start;
+
+            //same meaning of the eager compile time, also for on demand compilations and promotions
+            data->codegen_ns = tvm_stats_codegen_ns;
+            data->compile_ns = data->build_ns + data->codegen_ns;
+        }
+    }
+
+    if(result != JIT_MEMORY_RESTART)
+        tvm_stats_codegen_ns = 0;
+
+    tvm_stats_current = NULL;
+    return tvm_stats_default_manager->end_function(memctx, result);
+}
+
+void tvm_stats_setup
+    (jit_context_t context)
+{
+    if(tvm_stats_default_manager == NULL)
+    {
+        tvm_stats_default_manager = jit_default_memory_manager();
+
+        tvm_stats_manager = *tvm_stats_default_manager;
+        tvm_stats_manager.start_function = &tvm_stats_start_function;
+        tvm_stats_manager.end_function = &tvm_stats_end_function;
+    }
+
+    jit_context_set_memory_manager(context, &tvm_stats_manager);
+}
+
+/*Write a JSON string, names come from bytecode so they are escaped*/
+static void tvm_stats_write_string
+    (FILE* fp, const char* str)
+{
+    fputc('"', fp);
+
+    if(str != NULL)
+    {
+        for(; *str; ++str)
+        {
+            unsigned char c = *str;
+            if(c == '"' || c == '\\')
+                fprintf(fp, "\\%c", c);
+            else if(c < 0x20)
+                fprintf(fp, "\\u%04x", c);
+            else
+                fputc(c, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
+
+static void tvm_stats_write_function
+    (FILE* fp, jit_function_t function)
+{
+    tvm_func_data_t data = tvm_function_get_data(function);
+
+    fprintf(fp, "{\"name\": ");
+    tvm_stats_write_string(fp, data->name);
+    fprintf(fp, ", \"bytecode_len\": %lu", (unsigned long)(data->end - data->begin));
+    fprintf(fp, ", \"opcodes\": %lu", (unsigned long)(data->insns_end - data->insns));
+    fprintf(fp, ", \"compiled\": %s", jit_function_is_compiled(function) ? "true" : "false");
+    fprintf(fp, ", \"code_size\": %lu", (unsigned long)data->code_size);
+    fprintf(fp, ", \"build_ns\": %llu", (unsigned long long)data->build_ns);
+    fprintf(fp, ", \"compile_ns\": %llu", (unsigned long long)data->compile_ns);
+    fprintf(fp, ", \"codegen_ns\": %llu", (unsigned long long)data->codegen_ns);
+    fprintf(fp, ", \"opt_level\": %u", jit_function_get_optimization_level(function));
+    fprintf(fp, ", \"tier\": %d}", data->tier);
+}
+
+static void tvm_stats_write_module
+    (FILE* fp, tvm_module_t module)
+{
+    fprintf(fp, "    {\"name\": ");
+    tvm_stats_write_string(fp, module->name ? module->name : "<main>");
+    fprintf(fp, ", \"bytecode_len\": %lu", (unsigned long)(module->bytecode_end - module->bytecode));
+    fprintf(fp, ", \"load_ns\": %llu", (unsigned long long)module->load_ns);
+    fprintf(fp, ", \"parse_ns\": %llu", (unsigned long long)module->parse_ns);
+    fprintf(fp, ",\n      \"functions\": [\n        ");
+
+    tvm_stats_write_function(fp, module->start);
+
+    int i;
+    for(i = 0; i < module->funcs_len; ++i)
+    {
+        fprintf(fp, ",\n        ");
+        tvm_stats_write_function(fp, module->funcs[i]);
+    }
+
+    fprintf(fp, "\n      ]}");
+}
+
+int tvm_program_write_stats
+    (tvm_program_t program, const char* path)
+{
+    FILE* fp = fopen(path, "w");
+    if(fp == NULL)
+        return -1;
+
+    fprintf(fp, "{\n  \"modules\": [\n");
+
+    tvm_stats_write_module(fp, program->start);
+
+    int i;
+    for(i = 0; i < program->modules->allocd; ++i)
+    {
+        if(program->modules->hashcodes[i] != 0)
+        {
+            fprintf(fp, ",\n");
+            tvm_stats_write_module(fp, program->modules->data[i]);
+        }
+    }
+
+    fprintf(fp, "\n  ],\n");
+    fprintf(fp, "  \"types\": {\"requested\": %u, \"created\": %u},\n", program->types_requested, program->types_created);
+
+    tvm_gc_stats_t gc_stats;
+    tvm_gc_get_stats(&gc_stats);
+    fprintf(fp, "  \"gc\": {\"collections\": %llu, \"pauses\": %llu", (unsigned long long)gc_stats.collections, (unsigned long long)gc_stats.pauses);
+    fprintf(fp, ", \"pause_total_ns\": %llu", (unsigned long long)gc_stats.pause_total_ns);
+    fprintf(fp, ", \"pause_max_ns\": %llu", (unsigned long long)gc_stats.pause_max_ns);
+    fprintf(fp, ", \"heap_size\": %lu", (unsigned long)gc_stats.heap_size);
+    fprintf(fp, ", \"heap_max_size\": %lu}\n}\n", (unsigned long)gc_stats.heap_max_size);
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
@@ -0,0 +1,111 @@
+/*
+ * gc_descr_test.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+/*
+Check that objects allocated with tvm_type_gc_descr keep alive the objects
+referenced only by their pointer fields.
+*/
+
+#include "tvm.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REFERENT_SIZE 64
+#define PRESSURE 100000
+
+//disguised address of the referent, cleared by the collector if it is freed
+static GC_hidden_pointer referent_link;
+
+static jit_type_t struct_type
+    (void)
+{
+    //struct { int; void*; double; } with the pointer in the second word
+    jit_type_t fields[3];
+    fields[0] = jit_type_int;
+    fields[1] = jit_type_create_pointer(jit_type_void, 1);
+    fields[2] = jit_type_float64;
+
+    jit_type_t type = jit_type_create_struct(fields, 3, 1);
+    jit_type_free(fields[1]);
+    return type;
+}
+
+/*Allocate the typed object and its referent, no other reference is left on the stack*/
+static void* __attribute__((noinline)) alloc_object
+    (jit_type_t type, GC_descr descr)
+{
+    unsigned char* object = GC_malloc_explicitly_typed(jit_type_get_size(type), descr);
+    unsigned char* referent = GC_MALLOC(REFERENT_SIZE);
+
+    int i;
+    for(i = 0; i < REFERENT_SIZE; ++i)
+        referent[i] = (unsigned char)i;
+
+    *(void**)(object + jit_type_get_offset(type, 1)) = referent;
+
+    referent_link = GC_HIDE_POINTER(referent);
+    GC_general_register_disappearing_link((void**)&referent_link, referent);
+    return object;
+}
+
+int main
+    (void)
+{
+    GC_INIT();
+
+    jit_type_t type = struct_type();
+    GC_descr descr = tvm_type_gc_descr(type);
+
+    unsigned char* object = alloc_object(type, descr);
+
+    GC_gcollect();
+
+    //reuse the freed memory if the referent was wrongly collected
+    int i;
+    for(i = 0; i < PRESSURE; ++i)
+        GC_MALLOC(REFERENT_SIZE);
+    GC_gcollect();
+
+    unsigned char* referent = *(unsigned char**)(object + jit_type_get_offset(type, 1));
+
+    if(referent_link == 0)
+    {
+        fprintf(stderr, "gc error! the referent of a typed object was collected.\n");
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < REFERENT_SIZE; ++i)
+    {
+        if(referent[i] != (unsigned char)i)
+        {
+            fprintf(stderr, "gc error! the referent of a typed object was overwritten.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    jit_type_free(type);
+    printf("typed object referent survived the collection.\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+/*
+ * alloc.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*Start routine of VM threads, created through the GC pthread redirect so they are registered*/
+static void* tvm_thread_main
+    (void* arg)
+{
+    tvm_thread_t* thread = arg;
+
+    //the closure compiles the function on demand under the context build lock
+    void* closure = jit_function_to_closure(thread->function);
+
+    if(jit_type_get_kind(jit_type_get_return(jit_function_get_signature(thread->function))) == JIT_TYPE_VOID)
+        ((void (*)(void*)) closure)(thread->arg);
+    else
+        thread->result = ((void* (*)(void*)) closure)(thread->arg);
+
+    return NULL;
+}
+
+tvm_thread_t* tvm_thread_spawn
+    (jit_function_t function, void* arg)
+{
+    //traced by the collector, arg and result are kept alive until the join
+    tvm_thread_t* thread = GC_MALLOC(sizeof(tvm_thread_t));
+    thread->function = function;
+    thread->arg = arg;
+    thread->result = NULL;
+
+    if(pthread_create(&thread->id, NULL, &tvm_thread_main, thread) != 0)
+    {
+        fprintf(stderr, "fatal VM error! unable to create a thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return thread;
+}
+
+void* tvm_thread_join
+    (tvm_thread_t* thread)
+{
+    if(pthread_join(thread->id, NULL) != 0)
+    {
+        fprintf(stderr, "fatal VM error! unable to join a thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return thread->result;
+}
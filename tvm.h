@@ -32,6 +32,10 @@
 
 #define GC_THREADS
 #include <gc.h>
+#include <gc/gc_inline.h>
+#include <gc/gc_typed.h>
+
+#include <pthread.h>
 
 #define TYPEID_SBYTE                0x0
 #define TYPEID_UBYTE                0x1
@@ -64,8 +68,55 @@
 #define TYPEID_STRUCT               0x1a
 #define TYPEID_LIB_STRUCT           0x1b
 
+/*
+ * Module header
+ *
+ * A module begins, after the optional shebang line, with the NUL terminated
+ * TVM_MODULE_MAGIC and an u8 TVM_MODULE_VERSION. The version is incremented
+ * each time the layout of a section changes, modules of other versions are
+ * rejected by tvm_module_parse.
+ * Version 1 adds the attributes byte after the parameters of native imports.
+ */
+#define TVM_MODULE_MAGIC            "\x7fTRIPEL"
+#define TVM_MODULE_MAGIC_LEN        sizeof(TVM_MODULE_MAGIC)
+#define TVM_MODULE_VERSION          1
+
+
 /*
  * Tripel Bytecode Opcodes
+ *
+ * Operands follow the opcode little endian, u16 indices and u32 counts.
+ * Stack effects are written [before] -> [after], the top of the stack is on the right.
+ * A type is a TYPEID byte, TYPEID_POINTER is followed by the pointed type and
+ * TYPEID_STRUCT, TYPEID_LIB_STRUCT by an u16 struct index.
+ * The encodings below are the ones decoded by tvm_function_verify:
+ *
+ * STORE, STORE_VAL           u16 local              [val] -> []   (STORE_VAL stores through the local pointer)
+ * STORE_0..3, STORE_VAL_0..3 local in the opcode     [val] -> []
+ * STORE_GBL, STORE_E_GBL     u16 global             [val] -> []
+ * SET_AT                     -                      [ptr, idx, val] -> []
+ * SET_AT_C                   u32 index              [ptr, val] -> []
+ * SET_AT_0..3                index in the opcode    [ptr, val] -> []
+ * SET_FIELD                  u16 local, u16 field   [val] -> []   (the struct is the local)
+ * SET_FIELD_0..3             u16 local              [val] -> []
+ * SET_PT_FIELD               u16 field              [ptr, val] -> []
+ * SET_PT_FIELD_0..3          field in the opcode    [ptr, val] -> []
+ * PT_FIELD, AD_FIELD, AD_PT_FIELD   u16 field, the _0..3 forms have it in the opcode
+ * S_ALLOC, GC_ALLOC, GC_ATOM_ALLOC  -               [size] -> [void*]
+ * S_ALLOC_C, GC_ALLOC_C, GC_ATOM_ALLOC_C   u32 size [] -> [void*]
+ * CALL, E_CALL, N_CALL, EN_CALL     u16 function    [args...] -> [result]   (no result when void)
+ * FUNC_AD, E_FUNC_AD, N_FUNC_AD, EN_FUNC_AD   u16 function   [] -> [void*]
+ * CALL_PT                    inline signature: return type, u16 params number, params types
+ *                                                   [funcptr, args...] -> [result]
+ * RET                        -                      [val] -> returns
+ * RET_STD                    -                      returns from a void function
+ * VAL_ASSIGN                 -                      [ptr, val] -> []
+ * SIZEOF                     -                      [val] -> [nuint]
+ * SIZEOF_T                   type                   [] -> [nuint]
+ * SIZEOF_T_MUL               type                   [n] -> [nuint]
+ * DECL_T, CAST_T, CAST_PT    type                   (CAST_PT takes the pointed type)
+ * Arithmetic, bitwise and comparison ops pop [a, b] and push one value,
+ * MINUM, INC, DEC, NOT, NEG, IS_NULL, TO_BOOL and TO_BOOL_N replace the top value.
  */
 #define OP_NOP                      0x0
 #define OP_LD_I8                    0x1
@@ -240,6 +291,13 @@
 #define OP_CAST_E_ST                0xaa
 #define OP_CAST_T                   0xab
 #define OP_ABORT                    0xac
+#define OP_GC_ALLOC_ST              0xad
+#define OP_GC_ALLOC_E_ST            0xae
+#define OP_GC_ARRAY_ST              0xaf
+#define OP_GC_ARRAY_E_ST            0xb0
+#define OP_SPAWN                    0xb1
+#define OP_E_SPAWN                  0xb2
+#define OP_JOIN                     0xb3
 
 
 /*
@@ -254,6 +312,15 @@ Be careful or you will break all!
 /*Recurrent functions signature*/
 extern jit_type_t tvm_start_signature;
 extern jit_type_t tvm_gc_malloc_signature;
+extern jit_type_t tvm_promote_signature;
+extern jit_type_t tvm_exit_signature;
+extern jit_type_t tvm_profile_call_signature;
+extern jit_type_t tvm_gc_cache_signature;
+extern jit_type_t tvm_gc_refill_signature;
+extern jit_type_t tvm_gc_typed_malloc_signature;
+extern jit_type_t tvm_gc_typed_calloc_signature;
+extern jit_type_t tvm_thread_spawn_signature;
+extern jit_type_t tvm_thread_join_signature;
 
 /*String type*/
 extern jit_type_t tvm_type_string;
@@ -262,6 +329,53 @@ extern jit_type_t tvm_type_string;
 extern char* tvm_libpath;
 extern size_t tvm_libpath_len;
 
+/*Number of threads used to load imported modules, 0 means one per CPU*/
+extern int tvm_load_threads;
+
+/*
+Compile all functions before running (TRIPEL_EAGER), 0 means lazy compilation.
+TRIPEL_EAGER_MODULES restricts it to a comma separated list of module names, <main> is the start module.
+*/
+extern int tvm_eager;
+extern char* tvm_eager_modules;
+
+/*
+Calls and back edges after which a function compiled without optimizations
+is compiled again with the max optimization level, 0 disables tiering.
+*/
+extern jit_uint tvm_tier_threshold;
+
+/*
+When tiering is enabled collect branch and label counters in the first tier
+and use them to move cold blocks out of line in the second tier.
+Targets of indirect calls are collected too, monomorphic sites are called
+directly in the second tier.
+*/
+extern int tvm_pgo;
+
+/*
+Max instructions of a function inlined in its callers when they are optimized,
+0 disables inlining.
+*/
+extern int tvm_inline_limit;
+
+#define TVM_INLINE_DEFAULT_LIMIT 24
+
+/*Path of the JSON statistics written at exit, NULL disables the collection*/
+extern char* tvm_stats_path;
+
+/*
+Garbage collector tuning, read from the environment by TVM_INIT.
+TRIPEL_GC_MARKERS sets the parallel marker threads (GC_MARKERS, one per core by default),
+TRIPEL_GC_DIVISOR the free space divisor (bigger is less memory and more collections),
+TRIPEL_GC_HEAP the initial heap in bytes, TRIPEL_GC_INCREMENTAL enables the
+incremental/generational mode and TRIPEL_GC_PAUSE_MS its target pause.
+*/
+extern jit_nuint tvm_gc_divisor;
+extern jit_nuint tvm_gc_initial_heap;
+extern int tvm_gc_incremental;
+extern jit_uint tvm_gc_pause_ms;
+
 /*
 Setup macro, it must be the first instruction in main()
 or the library will not works.
@@ -269,12 +383,38 @@ It also initialize the garbage collector.
 */
 #define TVM_INIT \
 do { \
+    char* gc_markers = getenv("TRIPEL_GC_MARKERS"); \
+    if(gc_markers) \
+        setenv("GC_MARKERS", gc_markers, 1); \
     GC_INIT(); \
     tvm_libpath = getenv("TRIPEL_LIBPATH"); \
     if(tvm_libpath) \
         tvm_libpath_len = jit_strlen(tvm_libpath); \
     else tvm_libpath_len = 0; \
     \
+    char* load_threads = getenv("TRIPEL_LOAD_THREADS"); \
+    tvm_load_threads = load_threads ? atoi(load_threads) : 0; \
+    char* eager = getenv("TRIPEL_EAGER"); \
+    tvm_eager_modules = getenv("TRIPEL_EAGER_MODULES"); \
+    tvm_eager = eager ? atoi(eager) : tvm_eager_modules != NULL; \
+    char* tier_threshold = getenv("TRIPEL_TIER_THRESHOLD"); \
+    tvm_tier_threshold = tier_threshold ? strtoul(tier_threshold, NULL, 10) : 0; \
+    char* pgo = getenv("TRIPEL_PGO"); \
+    tvm_pgo = pgo ? atoi(pgo) : 0; \
+    char* inline_limit = getenv("TRIPEL_INLINE"); \
+    tvm_inline_limit = inline_limit ? atoi(inline_limit) : TVM_INLINE_DEFAULT_LIMIT; \
+    tvm_stats_path = getenv("TRIPEL_STATS"); \
+    \
+    char* gc_divisor = getenv("TRIPEL_GC_DIVISOR"); \
+    tvm_gc_divisor = gc_divisor ? strtoul(gc_divisor, NULL, 10) : 0; \
+    char* gc_heap = getenv("TRIPEL_GC_HEAP"); \
+    tvm_gc_initial_heap = gc_heap ? strtoul(gc_heap, NULL, 10) : 0; \
+    char* gc_incremental = getenv("TRIPEL_GC_INCREMENTAL"); \
+    tvm_gc_incremental = gc_incremental ? atoi(gc_incremental) : 0; \
+    char* gc_pause = getenv("TRIPEL_GC_PAUSE_MS"); \
+    tvm_gc_pause_ms = gc_pause ? strtoul(gc_pause, NULL, 10) : 0; \
+    tvm_gc_setup(); \
+    \
     jit_type_t param[] = { jit_type_ulong }; \
     \
     tvm_gc_malloc_signature = jit_type_create_signature( \
@@ -283,6 +423,70 @@ do { \
         param, 1, 0 \
     ); \
     \
+    jit_type_t promote_param[] = { jit_type_void_ptr }; \
+    \
+    tvm_promote_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void, \
+        promote_param, 1, 0 \
+    ); \
+    \
+    jit_type_t exit_param[] = { jit_type_int }; \
+    \
+    tvm_exit_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void, \
+        exit_param, 1, 0 \
+    ); \
+    \
+    jit_type_t profile_call_params[] = { jit_type_void_ptr, jit_type_void_ptr }; \
+    \
+    tvm_profile_call_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void, \
+        profile_call_params, 2, 0 \
+    ); \
+    \
+    tvm_gc_cache_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void_ptr, \
+        NULL, 0, 0 \
+    ); \
+    \
+    jit_type_t gc_refill_params[] = { jit_type_void_ptr, jit_type_nuint, jit_type_int }; \
+    \
+    tvm_gc_refill_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void_ptr, \
+        gc_refill_params, 3, 0 \
+    ); \
+    \
+    jit_type_t gc_typed_params[] = { jit_type_ulong, jit_type_ulong, jit_type_ulong }; \
+    \
+    tvm_gc_typed_malloc_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void_ptr, \
+        gc_typed_params, 2, 0 \
+    ); \
+    \
+    tvm_gc_typed_calloc_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void_ptr, \
+        gc_typed_params, 3, 0 \
+    ); \
+    \
+    tvm_thread_spawn_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void_ptr, \
+        profile_call_params, 2, 0 \
+    ); \
+    \
+    tvm_thread_join_signature = jit_type_create_signature( \
+        jit_abi_cdecl, \
+        jit_type_void_ptr, \
+        profile_call_params, 1, 0 \
+    ); \
+    \
     jit_type_t params[] = { jit_type_int, jit_type_void_ptr }; \
     \
     tvm_start_signature = jit_type_create_signature( \
@@ -291,7 +495,6 @@ do { \
         params, 2, 0 \
     ); \
     \
-    tvm_type_string = jit_type_create_pointer(jit_type_sbyte, 0); \
     jit_type_t types_table[] = { \
         jit_type_sbyte, \
         jit_type_ubyte, \
@@ -320,7 +523,8 @@ do { \
         jit_type_sys_double, \
         jit_type_sys_long_double \
     }; \
-    tvm_types_table = types_table; \
+    tvm_types_table = jit_malloc(sizeof(types_table)); \
+    jit_memcpy(tvm_types_table, types_table, sizeof(types_table)); \
     \
     tvm_type_string = jit_type_create_pointer(jit_type_sbyte, 0); \
 } while(0)
@@ -328,19 +532,93 @@ do { \
 /*Primitive types table*/
 extern jit_type_t* tvm_types_table;
 
+/*Monotonic clock in nanoseconds*/
+jit_ulong tvm_clock_ns
+    (void);
+
+/*
+Per thread free lists of small GC objects indexed by kind (GC_I_PTRFREE or GC_I_NORMAL)
+and granules. Compiled code pops constant size allocations from them inline.
+*/
+struct _tvm_gc_cache
+{
+    void* lists[2][GC_TINY_FREELISTS];
+};
+
+typedef struct _tvm_gc_cache tvm_gc_cache_t;
+
+/*Granules of the objects used for size bytes, the collector adds a byte at the end*/
+#define tvm_gc_granules(size) \
+    (((size) + GC_GRANULE_BYTES) / GC_GRANULE_BYTES)
+
+/*Get the cache of the calling thread, created on first use*/
+tvm_gc_cache_t* tvm_gc_thread_cache
+    (void);
+
+/*Fill an empty list with GC_generic_malloc_many and pop an object from it*/
+void* tvm_gc_refill
+    (void** list, jit_nuint granules, jit_int kind);
+
+/*Collector metrics, pauses are the stop the world intervals*/
+struct _tvm_gc_stats
+{
+    jit_ulong collections;
+    jit_ulong pauses;
+    jit_ulong pause_total_ns;
+    jit_ulong pause_max_ns;
+    jit_nuint heap_size;//after the last collection
+    jit_nuint heap_max_size;
+};
+
+typedef struct _tvm_gc_stats tvm_gc_stats_t;
+
+/*Apply the tuning globals and start collecting the metrics, called by TVM_INIT*/
+void tvm_gc_setup
+    (void);
+
+/*Copy the current collector metrics*/
+void tvm_gc_get_stats
+    (tvm_gc_stats_t* stats);
+
+/*
+Thread running a Tripel function that takes one word sized argument,
+created by the SPAWN opcodes and waited by JOIN.
+*/
+struct _tvm_thread
+{
+    pthread_t id;
+    jit_function_t function;
+    void* arg;
+    void* result;//NULL if the function returns void
+};
+
+typedef struct _tvm_thread tvm_thread_t;
+
+/*Start a thread that calls function with arg, the handle is a GC object*/
+tvm_thread_t* tvm_thread_spawn
+    (jit_function_t function, void* arg);
+
+/*Wait the end of a thread and return the result of its function*/
+void* tvm_thread_join
+    (tvm_thread_t* thread);
+
 struct _tvm_module;
 struct _tvm_program;
 
 typedef struct _tvm_program* tvm_program_t;
 typedef struct _tvm_module* tvm_module_t;
 
-/*Simple char*->void* map*/
+/*
+Open addressing char*->void* map with linear probing.
+The slots are split in parallel arrays so that probing scans only hashcodes,
+an hashcode equal to 0 marks an empty slot.
+*/
 struct _tvm_map
 {
-    int* hashcodes;
+    jit_uint* hashcodes;
     char** keys;
     int count;
-    int allocd;
+    int allocd;//always a power of 2
 
     void** data;
 };
@@ -355,7 +633,7 @@ tvm_map_t tvm_map_create
 void tvm_map_free
     (tvm_map_t map);
 
-/*Add an element to the map (no check for the duplicate keys)*/
+/*Add an element to the map (if the key is already present the old value is kept)*/
 void tvm_map_add
     (tvm_map_t map, char* key, void* data);
 
@@ -363,6 +641,78 @@ void tvm_map_add
 void* tvm_map_get
     (tvm_map_t map, char* key);
 
+/*
+Fixed size pool of worker threads.
+Workers are created with the GC pthread redirect so they can use the GC heap.
+*/
+typedef void (*tvm_pool_func_t)(void*);
+
+struct _tvm_pool_job;
+
+struct _tvm_pool
+{
+    pthread_t* threads;
+    int threads_num;
+
+    struct _tvm_pool_job* first;
+    struct _tvm_pool_job* last;
+    int pending;//submitted and not yet completed jobs
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobs_cond;
+    pthread_cond_t done_cond;
+};
+
+typedef struct _tvm_pool* tvm_pool_t;
+
+/*Get the number of online CPUs*/
+int tvm_pool_default_threads
+    (void);
+
+/*Alloc a pool and start its workers, threads_num <= 0 means one per CPU*/
+tvm_pool_t tvm_pool_create
+    (int threads_num);
+
+/*Queue a job, it can be called also from a job*/
+void tvm_pool_submit
+    (tvm_pool_t pool, tvm_pool_func_t func, void* arg);
+
+/*Wait until all the submitted jobs are completed*/
+void tvm_pool_wait
+    (tvm_pool_t pool);
+
+/*Complete the queued jobs, join the workers and free the pool*/
+void tvm_pool_free
+    (tvm_pool_t pool);
+
+/*
+Decoded instruction, function bodies are verified once at link time
+and the compiler reads them instead of the bytecode.
+*/
+struct _tvm_insn
+{
+    jit_ubyte opcode;
+    jit_ubyte flags;//TVM_INSN_* flags set by the analyses
+    jit_ushort index;//local, argument, label, field or symbol index
+    jit_ushort pops;//stack effect computed by the verifier
+    jit_ubyte pushes;
+    jit_type_t type;//resolved operand or element type (interned), NULL if known only at build time
+    union
+    {
+        jit_nint nint;//integer constant, size, element index or field offset
+        jit_long lval;
+        jit_float32 f32;
+        jit_float64 f64;
+        void* ptr;//string, global data, function or tvm_funcptr_t*
+    } imm;
+};
+
+typedef struct _tvm_insn tvm_insn_t;
+
+/*The allocation does not escape the function and is built in its frame*/
+#define TVM_INSN_STACK              0x1
+
 /*
 Record used to store all info nedded by a function to be build.
 */
@@ -375,10 +725,43 @@ struct _tvm_func_data
     jit_ushort stack_len;
     jit_ushort locals_num;
     jit_ushort labels_num;
+
+    tvm_insn_t* insns;//set by tvm_function_verify
+    tvm_insn_t* insns_end;
+    jit_ushort max_stack;//computed, stack_len is not trusted
+
+    jit_ulong compile_ns;//build and native code generation time of the last compilation, eager or with stats
+    jit_ulong build_ns;//time of the last build, only with stats
+    jit_ulong codegen_ns;//native code generation time of the last compilation, only with stats
+    jit_uint code_size;//bytes of generated code, only with stats
+
+    jit_uint counter;//calls and back edges in the first tier
+    int tier;//0 not optimized, 1 optimized
+
+    jit_uint* label_counts;//executions of each label in the first tier
+    jit_uint** site_counts;//not taken and taken counts of each conditional jump
+    int sites_num;
+    struct _tvm_call_profile* call_profiles;//targets of each indirect call
+    int calls_num;
+
+    void* native_entry;//entry given to embedders, NULL until requested
 };
 
 typedef struct _tvm_func_data* tvm_func_data_t;
 
+/*
+Profile of an indirect call site collected in the first tier.
+The first target seen is kept, calls to other targets are counted as misses.
+*/
+struct _tvm_call_profile
+{
+    void* target;
+    jit_uint hits;
+    jit_uint misses;
+};
+
+typedef struct _tvm_call_profile tvm_call_profile_t;
+
 /*Alloc a tvm_func_data_t and set the fields*/
 tvm_func_data_t tvm_func_data_create
     (tvm_module_t module, unsigned char* begin, unsigned char* end, char* name, jit_ushort stack_len, jit_ushort locals_num, jit_ushort labels_num);
@@ -391,10 +774,54 @@ jit_function_t tvm_function_create
 #define tvm_function_get_data(func) \
     (tvm_func_data_t) jit_function_get_meta(func, 0)
 
+/*
+Decode and check the body of a function, imports of its module must be resolved.
+Malformed bytecode is a fatal error.
+*/
+void tvm_function_verify
+    (jit_function_t function);
+
+/*
+Find the constant size GC allocations whose pointer never leaves the function
+and mark them with TVM_INSN_STACK. The function must be verified.
+*/
+void tvm_function_escape_analysis
+    (jit_function_t function);
+
 /*Build process, called on demand*/
 int tvm_function_build
     (jit_function_t function);
 
+/*Compile again a first tier function with the max optimization level*/
+void tvm_function_promote
+    (jit_function_t function);
+
+/*
+Build and compile a function now if it is not compiled yet.
+libjit allows one build at a time per context, so the context build lock is held.
+*/
+void tvm_function_compile
+    (jit_function_t function);
+
+/*
+Compile a function with its final tier and get its native entry, cached in the function data.
+It is not recompiled anymore so the entry skips the libjit indirector, NULL on failure.
+*/
+void* tvm_function_native_entry
+    (jit_function_t function);
+
+/*
+Attributes of a native function, a byte after its parameters types.
+NOTHROW and NORETURN are passed to libjit as call flags, PURE calls with
+constant arguments are evaluated when the caller is built and repeated calls
+with the same number arguments reuse the first result.
+LEAF functions do not call back into the VM.
+*/
+#define TVM_NATIVE_NOTHROW          0x1
+#define TVM_NATIVE_NORETURN         0x2
+#define TVM_NATIVE_PURE             0x4
+#define TVM_NATIVE_LEAF             0x8
+
 /*
 Record used to store a c function pointer and its signature.
 */
@@ -402,14 +829,12 @@ struct _tvm_funcptr
 {
     void* functor;
     jit_type_t signature;
+    int attributes;//TVM_NATIVE_* flags
+    int call_flags;//JIT_CALL_* flags derived from the attributes
 };
 
 typedef struct _tvm_funcptr tvm_funcptr_t;
 
-/*Free the signature*/
-#define tvm_funcptr_free(funcptr) \
-    jit_type_free((funcptr).signature)
-
 /*
 Record used to store a struct type representation (inside jit) and its fields names.
 */
@@ -417,6 +842,7 @@ struct _tvm_struct
 {
     char** fields_names;//pointers to bytecode, must not freed
     jit_type_t type;
+    GC_descr descr;//typed GC descriptor of the layout
 };
 
 typedef struct _tvm_struct tvm_struct_t;
@@ -426,7 +852,7 @@ Record that contains a global var allocated by the GC and its type.
 */
 struct _tvm_global_var
 {
-    void* data;//use GC_malloc
+    void* data;//points into the globals segment of the module
     jit_type_t type;//pointer type
 };
 
@@ -440,7 +866,7 @@ struct _tvm_module
     tvm_program_t program;
     char* name;//must not freed
 
-    unsigned char* bytecode;
+    unsigned char* bytecode;//obtained with tvm_bytecode_load
     unsigned char* bytecode_end;
 
     tvm_map_t structs_map;//pointers in bytecode
@@ -453,9 +879,20 @@ struct _tvm_module
     tvm_global_var_t* globals;
     tvm_funcptr_t* c_funcs;
 
+    void* globals_segment;//contiguous data of the globals, a GC root
+    jit_nuint globals_size;
+
     jit_function_t start;
     jit_function_t* funcs;
 
+    unsigned char* imports;//libraries table in bytecode
+    tvm_module_t* libs;//imported modules, set by tvm_module_link
+    jit_ushort libs_len;
+    int initialized;//start entry already called
+
+    jit_ulong load_ns;//read time of the bytecode, only with stats
+    jit_ulong parse_ns;
+
     tvm_struct_t** ext_structs;
     tvm_global_var_t** ext_globals;
     tvm_funcptr_t** ext_c_funcs;
@@ -473,19 +910,46 @@ struct _tvm_module
     jit_ushort ext_funcs_len;
 };
 
+/*
+Map a bytecode file read-only in memory and set *bytecode_end,
+NULL if the file can't be read.
+Strings and names of a module point straight into the mapping so pages
+of the same library are shared between processes.
+*/
+unsigned char* tvm_bytecode_load
+    (const char* path, unsigned char** bytecode_end);
+
+/*Release a bytecode obtained with tvm_bytecode_load*/
+void tvm_bytecode_unload
+    (unsigned char* bytecode, unsigned char* bytecode_end);
+
 /*Read and get a type associated with a module*/
 jit_type_t tvm_module_get_type
-    (tvm_module_t module, unsigned char** buf); //must freed with jit_type_free
+    (tvm_module_t module, unsigned char** buf); //interned, must not freed
 
 /*Read a type associated with a module and get its pointer type*/
 #define tvm_module_get_pointer_type(module, buf) \
-    jit_type_create_pointer(tvm_module_get_type(module, buf), 0)
+    tvm_program_pointer_type((module)->program, tvm_module_get_type(module, buf))
 
-/*Parse bytecode and fill module fields*/
+/*Parse bytecode and fill module fields, imports are not resolved*/
+void tvm_module_parse
+    (tvm_module_t module);
+
+/*
+Resolve the imports of a module and of its libraries, they must be already parsed.
+Functions bodies are verified once the imports of their module are resolved.
+*/
+void tvm_module_link
+    (tvm_module_t module);
+
+/*
+Parse a module, load and parse all the imported modules in parallel
+and link them. Start entries of libraries are not called, see tvm_program_init.
+*/
 void tvm_module_build
     (tvm_module_t module);
 
-/*Alloc a module and set bytecode pointers fields*/
+/*Alloc a module and set bytecode pointers fields (from tvm_bytecode_load)*/
 tvm_module_t tvm_module_create
     (tvm_program_t program, unsigned char* bytecode, unsigned char* bytecode_end);
 
@@ -493,7 +957,34 @@ tvm_module_t tvm_module_create
 tvm_module_t tvm_module_create_build
     (tvm_program_t program, unsigned char* bytecode, unsigned char* bytecode_end);
 
-/*Free a module and all of its fields*/
+/*
+Compile the start entry and all functions of a module.
+libjit builds one function at a time per context, so it is done serially.
+*/
+void tvm_module_compile
+    (tvm_module_t module);
+
+/*
+Native entry of a Tripel function for embedders, entry must be cast to a C function
+pointer that matches signature and can be called with no marshalling.
+*/
+struct _tvm_native_func
+{
+    void* entry;
+    jit_type_t signature;
+};
+
+typedef struct _tvm_native_func tvm_native_func_t;
+
+/*
+Resolve a function of a module by name, compile it and fill *func, 0 if it is not found.
+The pointer stays valid until the program is freed, libraries must be initialized
+with tvm_program_init before calling it.
+*/
+int tvm_module_get_native
+    (tvm_module_t module, char* name, tvm_native_func_t* func);
+
+/*Free a module and all of its fields, the bytecode is unloaded*/
 void tvm_module_free
     (tvm_module_t module);
 
@@ -505,15 +996,59 @@ struct _tvm_program
     tvm_module_t start;
     tvm_map_t modules;
     jit_context_t context;
+
+    tvm_map_t types;//interned types, keys encode the shape
+    jit_uint types_requested;
+    jit_uint types_created;
+
+    //protects modules, types and the jit_context functions list while loading in parallel
+    pthread_mutex_t lock;
 };
 
-/*Alloc a program and set bytecode pointers in start module*/
+/*Alloc a program and set bytecode pointers in start module (from tvm_bytecode_load)*/
 tvm_program_t tvm_program_create
     (unsigned char* bytecode, unsigned char* bytecode_end);
 
+/*
+Get an interned pointer, struct or signature type, identical shapes share the same jit_type_t.
+Components must be primitive or interned types, the result must not freed
+and lives until tvm_program_free.
+*/
+jit_type_t tvm_program_pointer_type
+    (tvm_program_t program, jit_type_t ref);
+
+jit_type_t tvm_program_struct_type
+    (tvm_program_t program, jit_type_t* fields, unsigned int fields_num);
+
+jit_type_t tvm_program_signature_type
+    (tvm_program_t program, jit_type_t ret_type, jit_type_t* params, unsigned int params_num);
+
+/*Collect the generated code size of the functions of a context, used when stats are enabled*/
+void tvm_stats_setup
+    (jit_context_t context);
+
+/*Write load and compile statistics of a program as JSON, -1 on error*/
+int tvm_program_write_stats
+    (tvm_program_t program, const char* path);
+
+/*Make the typed GC descriptor of a struct type, only pointer and pointer sized integer fields are scanned*/
+GC_descr tvm_type_gc_descr
+    (jit_type_t type);
+
+/*Free all the interned types*/
+void tvm_program_types_free
+    (tvm_program_t program);
+
 /*Search a module in a program*/
-#define tvm_program_find_module(program, name) \
-    (tvm_module_t) tvm_map_get(program->modules, name)
+tvm_module_t tvm_program_find_module
+    (tvm_program_t program, char* name);
+
+/*
+Search a module in a program and if not found register a new unbuilt module
+with that name. *created is set to 1 when the module is new.
+*/
+tvm_module_t tvm_program_find_add_module
+    (tvm_program_t program, char* name, int* created);
 
 /*Build start module*/
 #define tvm_program_build(program) \
@@ -523,10 +1058,29 @@ tvm_program_t tvm_program_create
 tvm_program_t tvm_program_create_build
     (unsigned char* bytecode, unsigned char* bytecode_end);
 
+/*
+Compile all functions of the modules selected by tvm_eager_modules, or of all
+modules when it is NULL, before running. Return the wall time in nanoseconds.
+*/
+jit_ulong tvm_program_compile
+    (tvm_program_t program);
+
+/*Check if a module is compiled by tvm_program_compile*/
+int tvm_program_eager_module
+    (tvm_program_t program, tvm_module_t module);
+
+/*Call the start entries of all the libraries, dependencies first*/
+void tvm_program_init
+    (tvm_program_t program);
+
 /*Free a program, destroy the jit_context and free all modules*/
 void tvm_program_free
     (tvm_program_t program);
 
+/*Resolve a function of the start module, see tvm_module_get_native*/
+#define tvm_program_get_native(program, name, func) \
+    tvm_module_get_native((program)->start, name, func)
+
 /*Run start function of the start module*/
 #define tvm_program_run(program, argc, argv) \
     ((int (*)(int, char**)) jit_function_to_closure((program)->start->start))(argc, argv)
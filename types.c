@@ -0,0 +1,192 @@
+/*
+ * types.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+
+#define TVM_TYPE_POINTER    'P'
+#define TVM_TYPE_STRUCT     'T'
+#define TVM_TYPE_SIGNATURE  'S'
+
+/*
+Build the key of a shape, the kind followed by the addresses of its components in hex.
+Components are interned or primitive so equal addresses mean equal types.
+*/
+static char* tvm_types_key
+    (char kind, jit_type_t first, jit_type_t* types, unsigned int num)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    char* key = jit_malloc(2 + (num + 1) * (sizeof(void*) * 2 + 1));
+    char* it = key;
+    *(it++) = kind;
+
+    unsigned int i;
+    for(i = 0; i <= num; ++i)
+    {
+        jit_nuint addr = (jit_nuint)(i == 0 ? first : types[i - 1]);
+
+        int shift;
+        for(shift = sizeof(void*) * 8 - 4; shift >= 0; shift -= 4)
+            *(it++) = digits[(addr >> shift) & 0xf];
+        *(it++) = ',';
+    }
+
+    *it = 0;
+    return key;
+}
+
+/*Search a shape in the cache and create it if not present*/
+static jit_type_t tvm_types_intern
+    (tvm_program_t program, char kind, jit_type_t first, jit_type_t* types, unsigned int num)
+{
+    char* key = tvm_types_key(kind, first, types, num);
+
+    //refcounts of jit types are not atomic, they are changed only under the lock
+    pthread_mutex_lock(&program->lock);
+
+    ++program->types_requested;
+
+    jit_type_t type = tvm_map_get(program->types, key);
+    if(type != NULL)
+    {
+        pthread_mutex_unlock(&program->lock);
+        jit_free(key);
+        return type;
+    }
+
+    //components are increfed, the cache owns one reference of each type
+    switch(kind)
+    {
+        case TVM_TYPE_POINTER:
+        type = jit_type_create_pointer(first, 1);
+        break;
+
+        case TVM_TYPE_STRUCT:
+        type = jit_type_create_struct(types, num, 1);
+        break;
+
+        case TVM_TYPE_SIGNATURE:
+        type = jit_type_create_signature(jit_abi_cdecl, first, types, num, 1);
+        break;
+    }
+
+    tvm_map_add(program->types, key, type);
+    ++program->types_created;
+
+    pthread_mutex_unlock(&program->lock);
+    return type;
+}
+
+jit_type_t tvm_program_pointer_type
+    (tvm_program_t program, jit_type_t ref)
+{
+    return tvm_types_intern(program, TVM_TYPE_POINTER, ref, NULL, 0);
+}
+
+jit_type_t tvm_program_struct_type
+    (tvm_program_t program, jit_type_t* fields, unsigned int fields_num)
+{
+    //the first component is unused, NULL keeps keys of structs distinct from the others
+    return tvm_types_intern(program, TVM_TYPE_STRUCT, NULL, fields, fields_num);
+}
+
+jit_type_t tvm_program_signature_type
+    (tvm_program_t program, jit_type_t ret_type, jit_type_t* params, unsigned int params_num)
+{
+    return tvm_types_intern(program, TVM_TYPE_SIGNATURE, ret_type, params, params_num);
+}
+
+/*Set the bits of the words of type at offset that can hold a pointer*/
+static void tvm_type_gc_bitmap
+    (jit_type_t type, jit_nuint offset, GC_word* bitmap)
+{
+    //normalizing would turn pointers into integers
+    type = jit_type_remove_tags(type);
+
+    switch(jit_type_get_kind(type))
+    {
+        case JIT_TYPE_PTR:
+        case JIT_TYPE_SIGNATURE:
+        if(offset % sizeof(GC_word) == 0)
+            GC_set_bit(bitmap, offset / sizeof(GC_word));
+        break;
+
+        //integers as wide as a pointer are scanned conservatively
+        case JIT_TYPE_NINT:
+        case JIT_TYPE_NUINT:
+        case JIT_TYPE_LONG:
+        case JIT_TYPE_ULONG:
+        if(jit_type_get_size(type) == sizeof(GC_word) && offset % sizeof(GC_word) == 0)
+            GC_set_bit(bitmap, offset / sizeof(GC_word));
+        break;
+
+        case JIT_TYPE_STRUCT:
+        {
+            unsigned int i;
+            for(i = 0; i < jit_type_num_fields(type); ++i)
+                tvm_type_gc_bitmap(jit_type_get_field(type, i), offset + jit_type_get_offset(type, i), bitmap);
+            break;
+        }
+
+        case JIT_TYPE_UNION:
+        {
+            //fields overlap, every aligned word is scanned
+            jit_nuint i;
+            for(i = (offset + sizeof(GC_word) - 1) / sizeof(GC_word); (i + 1) * sizeof(GC_word) <= offset + jit_type_get_size(type); ++i)
+                GC_set_bit(bitmap, i);
+            break;
+        }
+    }
+}
+
+GC_descr tvm_type_gc_descr
+    (jit_type_t type)
+{
+    size_t words = (jit_type_get_size(type) + sizeof(GC_word) - 1) / sizeof(GC_word);
+    GC_word* bitmap = jit_calloc(words / GC_WORDSZ + 1, sizeof(GC_word));
+
+    tvm_type_gc_bitmap(type, 0, bitmap);
+    GC_descr descr = GC_make_descriptor(bitmap, words);
+
+    jit_free(bitmap);
+    return descr;
+}
+
+void tvm_program_types_free
+    (tvm_program_t program)
+{
+    //references between interned types are counted so the order does not matter
+    int i;
+    for(i = 0; i < program->types->allocd; ++i)
+    {
+        if(program->types->hashcodes[i] != 0)
+        {
+            jit_type_free(program->types->data[i]);
+            jit_free(program->types->keys[i]);
+        }
+    }
+
+    tvm_map_free(program->types);
+}
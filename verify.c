@@ -0,0 +1,975 @@
+/*
+ * verify.c
+ *
+ * Copyright 2017 Andrea Fioraldi <andreafioraldi@gmail.com>
+ *
+ * This file is part of Tripel Virtual Machine.
+ *
+ * Tripel Virtual Machine is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tripel Virtual Machine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ *
+ */
+
+#include "tvm.h"
+#include "from_bytes.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/*
+State of the verification of a function.
+Stack slots and locals keep their type when it is known, NULL otherwise.
+*/
+struct _tvm_verifier
+{
+    tvm_func_data_t data;
+    tvm_module_t module;
+    jit_type_t signature;
+
+    unsigned char* buf;
+    unsigned char* insn_begin;
+
+    jit_type_t* stack;
+    int depth;
+    int max_depth;
+    int stack_allocd;
+    int pops;//stack effect of the current instruction
+    int pushes;
+
+    jit_type_t* locals;
+    char* locals_declared;
+    char* labels_placed;
+    unsigned char** labels_jumps;//first jump to each label, NULL if none
+};
+
+typedef struct _tvm_verifier* tvm_verifier_t;
+
+static void tvm_verify_fail
+    (tvm_verifier_t v, const char* msg)
+{
+    fprintf(stderr, "fatal VM error! %s at offset %lx of function %s, opcode %x.\n",
+        msg, (unsigned long)(v->insn_begin - v->data->begin), v->data->name, *v->insn_begin);
+    exit(EXIT_FAILURE);
+}
+
+/*Fail if less than n bytes are left in the function body*/
+#define tvm_verify_need(v, n) \
+do { \
+    if((v)->data->end - (v)->buf < (n)) \
+        tvm_verify_fail(v, "truncated instruction"); \
+} while(0)
+
+static jit_ushort tvm_verify_ushort
+    (tvm_verifier_t v)
+{
+    tvm_verify_need(v, 2);
+    return tvm_ushort_from_bytes(v->buf);
+}
+
+static jit_uint tvm_verify_uint
+    (tvm_verifier_t v)
+{
+    tvm_verify_need(v, 4);
+    return tvm_uint_from_bytes(v->buf);
+}
+
+static jit_ushort tvm_verify_index
+    (tvm_verifier_t v, int bound, const char* msg)
+{
+    jit_ushort idx = tvm_verify_ushort(v);
+    if(idx >= bound)
+        tvm_verify_fail(v, msg);
+    return idx;
+}
+
+static void tvm_verify_push
+    (tvm_verifier_t v, jit_type_t type)
+{
+    if(v->depth == v->stack_allocd)
+    {
+        v->stack_allocd *= 2;
+        v->stack = jit_realloc(v->stack, sizeof(jit_type_t) * v->stack_allocd);
+    }
+
+    v->stack[v->depth++] = type;
+    ++v->pushes;
+    if(v->depth > v->max_depth)
+        v->max_depth = v->depth;
+}
+
+static jit_type_t tvm_verify_pop
+    (tvm_verifier_t v)
+{
+    if(v->depth == 0)
+        tvm_verify_fail(v, "stack underflow");
+    ++v->pops;
+    return v->stack[--v->depth];
+}
+
+static void tvm_verify_pop_n
+    (tvm_verifier_t v, int n)
+{
+    while(n--)
+        tvm_verify_pop(v);
+}
+
+/*Read a type, pointer types are interned*/
+static jit_type_t tvm_verify_type
+    (tvm_verifier_t v)
+{
+    tvm_verify_need(v, 1);
+    int id = *(v->buf++);
+
+    if(id < TYPEID_POINTER)
+        return tvm_types_table[id];
+
+    switch(id)
+    {
+        case TYPEID_POINTER:
+        return tvm_program_pointer_type(v->module->program, tvm_verify_type(v));
+
+        case TYPEID_STRUCT:
+        {
+            jit_ushort idx = tvm_verify_index(v, v->module->structs_len, "struct index out of range");
+            return v->module->structs[idx].type;
+        }
+        case TYPEID_LIB_STRUCT:
+        {
+            jit_ushort idx = tvm_verify_index(v, v->module->ext_structs_len, "external struct index out of range");
+            if(v->module->ext_structs[idx] == NULL)
+                tvm_verify_fail(v, "unresolved external struct");
+            return v->module->ext_structs[idx]->type;
+        }
+    }
+
+    tvm_verify_fail(v, "invalid type id");
+    return NULL;
+}
+
+/*Type pointed by a pointer slot, NULL if unknown*/
+static jit_type_t tvm_verify_ref
+    (tvm_verifier_t v, jit_type_t type)
+{
+    if(type == NULL)
+        return NULL;
+    if(!jit_type_is_pointer(type))
+        tvm_verify_fail(v, "dereference of a non pointer value");
+    return jit_type_get_ref(type);
+}
+
+/*Resolve type and offset of field idx of a struct slot, if the struct is unknown they are resolved at build time*/
+static void tvm_verify_field
+    (tvm_verifier_t v, tvm_insn_t* insn, jit_type_t type, unsigned int idx)
+{
+    if(type == NULL)
+        return;
+
+    if(!jit_type_is_struct(type))
+        tvm_verify_fail(v, "field of a non struct value");
+    if(idx >= jit_type_num_fields(type))
+        tvm_verify_fail(v, "field index out of range");
+
+    insn->type = jit_type_get_field(type, idx);
+    insn->imm.nint = jit_type_get_offset(type, idx);
+}
+
+/*Read a local index, it must be already declared unless it is a declaration*/
+static jit_ushort tvm_verify_local
+    (tvm_verifier_t v, int declaration)
+{
+    jit_ushort idx = tvm_verify_index(v, v->data->locals_num, "local index out of range");
+    if(!declaration && !v->locals_declared[idx])
+        tvm_verify_fail(v, "use of an undeclared local");
+    return idx;
+}
+
+/*Pop the parameters of a call and push the result*/
+static void tvm_verify_call
+    (tvm_verifier_t v, jit_type_t signature)
+{
+    tvm_verify_pop_n(v, jit_type_num_params(signature));
+
+    jit_type_t ret = jit_type_get_return(signature);
+    if(jit_type_get_kind(ret) != JIT_TYPE_VOID)
+        tvm_verify_push(v, ret);
+}
+
+/*Word sized and not floating, a value that fits the argument and the result of a thread*/
+static int tvm_verify_is_word
+    (jit_type_t type)
+{
+    int kind = jit_type_get_kind(jit_type_normalize(type));
+    return jit_type_get_size(type) == sizeof(void*) &&
+           kind != JIT_TYPE_FLOAT32 && kind != JIT_TYPE_FLOAT64 && kind != JIT_TYPE_NFLOAT;
+}
+
+/*Check the signature of a thread function, pop its argument and push the handle*/
+static void tvm_verify_spawn
+    (tvm_verifier_t v, jit_type_t signature)
+{
+    jit_type_t ret = jit_type_get_return(signature);
+    if(jit_type_num_params(signature) != 1 || !tvm_verify_is_word(jit_type_get_param(signature, 0)) ||
+       (jit_type_get_kind(ret) != JIT_TYPE_VOID && !tvm_verify_is_word(ret)))
+        tvm_verify_fail(v, "thread function must take and return one word");
+
+    tvm_verify_pop(v);
+    tvm_verify_push(v, jit_type_void_ptr);
+}
+
+void tvm_function_verify
+    (jit_function_t function)
+{
+    tvm_func_data_t data = tvm_function_get_data(function);
+
+    struct _tvm_verifier verifier;
+    tvm_verifier_t v = &verifier;
+
+    v->data = data;
+    v->module = data->module;
+    v->signature = jit_function_get_signature(function);
+    v->buf = data->begin;
+
+    v->stack_allocd = 16;
+    v->stack = jit_malloc(sizeof(jit_type_t) * v->stack_allocd);
+    v->depth = 0;
+    v->max_depth = 0;
+
+    v->locals = jit_calloc(data->locals_num + 1, sizeof(jit_type_t));
+    v->locals_declared = jit_calloc(data->locals_num + 1, sizeof(char));
+    v->labels_placed = jit_calloc(data->labels_num + 1, sizeof(char));
+    v->labels_jumps = jit_calloc(data->labels_num + 1, sizeof(unsigned char*));
+
+    //an instruction is at least one byte
+    tvm_insn_t* insns = jit_malloc(sizeof(tvm_insn_t) * (data->end - data->begin + 1));
+    tvm_insn_t* insn = insns;
+
+    tvm_module_t module = v->module;
+
+    while(v->buf < data->end)
+    {
+        v->insn_begin = v->buf;
+
+        insn->opcode = *(v->buf++);
+        insn->flags = 0;
+        insn->index = 0;
+        insn->type = NULL;
+        insn->imm.lval = 0;
+        v->pops = 0;
+        v->pushes = 0;
+
+        switch(insn->opcode)
+        {
+            case OP_NOP:
+            case OP_RET_STD:
+            break;
+
+            case OP_LD_I8:
+            tvm_verify_need(v, 1);
+            insn->type = jit_type_sbyte;
+            insn->imm.nint = (jit_sbyte)*(v->buf++);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_U8:
+            tvm_verify_need(v, 1);
+            insn->type = jit_type_ubyte;
+            insn->imm.nint = *(v->buf++);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_I16:
+            tvm_verify_need(v, 2);
+            insn->type = jit_type_short;
+            insn->imm.nint = tvm_short_from_bytes(v->buf);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_U16:
+            insn->type = jit_type_ushort;
+            insn->imm.nint = tvm_verify_ushort(v);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_I32:
+            tvm_verify_need(v, 4);
+            insn->type = jit_type_int;
+            insn->imm.nint = tvm_int_from_bytes(v->buf);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_U32:
+            insn->type = jit_type_uint;
+            insn->imm.nint = tvm_verify_uint(v);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_I64:
+            tvm_verify_need(v, 8);
+            insn->type = jit_type_long;
+            insn->imm.lval = tvm_long_from_bytes(v->buf);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_U64:
+            tvm_verify_need(v, 8);
+            insn->type = jit_type_ulong;
+            insn->imm.lval = (jit_long)tvm_ulong_from_bytes(v->buf);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_F32:
+            tvm_verify_need(v, 4);
+            insn->type = jit_type_float32;
+            insn->imm.f32 = tvm_float32_from_bytes(v->buf);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_F64:
+            tvm_verify_need(v, 8);
+            insn->type = jit_type_float64;
+            insn->imm.f64 = tvm_float64_from_bytes(v->buf);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_NULL:
+            insn->type = jit_type_void_ptr;
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_LD_STR:
+            insn->index = tvm_verify_index(v, module->strings_len, "string index out of range");
+            insn->type = tvm_type_string;
+            insn->imm.ptr = module->strings[insn->index];
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_ADDR:
+            case OP_PUSH_AD_0:
+            case OP_PUSH_AD_1:
+            case OP_PUSH_AD_2:
+            case OP_PUSH_AD_3:
+            case OP_PUSH_AD:
+            {
+                if(insn->opcode == OP_ADDR)
+                    tvm_verify_pop(v);
+                else if(insn->opcode == OP_PUSH_AD)
+                    insn->index = tvm_verify_local(v, 0);
+                else
+                {
+                    insn->index = insn->opcode - OP_PUSH_AD_0;
+                    if(insn->index >= data->locals_num || !v->locals_declared[insn->index])
+                        tvm_verify_fail(v, "use of an undeclared local");
+                }
+
+                //pointer types are created at build time
+                tvm_verify_push(v, NULL);
+                break;
+            }
+
+            case OP_VAL:
+            insn->type = tvm_verify_ref(v, tvm_verify_pop(v));
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_AT:
+            case OP_AD_AT:
+            {
+                tvm_verify_pop(v);
+                jit_type_t type = tvm_verify_pop(v);
+                insn->type = tvm_verify_ref(v, type);
+                tvm_verify_push(v, insn->opcode == OP_AT ? insn->type : type);
+                break;
+            }
+
+            case OP_AT_C:
+            case OP_AT_1:
+            case OP_AT_2:
+            case OP_AT_3:
+            case OP_AD_AT_C:
+            case OP_AD_AT_1:
+            case OP_AD_AT_2:
+            case OP_AD_AT_3:
+            {
+                jit_uint n;
+                if(insn->opcode == OP_AT_C || insn->opcode == OP_AD_AT_C)
+                    n = tvm_verify_uint(v);
+                else if(insn->opcode <= OP_AT_3)
+                    n = insn->opcode - OP_AT_C;
+                else n = insn->opcode - OP_AD_AT_C;
+
+                jit_type_t type = tvm_verify_pop(v);
+                insn->type = tvm_verify_ref(v, type);
+                insn->imm.nint = n;
+                tvm_verify_push(v, insn->opcode <= OP_AT_3 ? insn->type : type);
+                break;
+            }
+
+            case OP_FIELD:
+            case OP_FIELD_0:
+            case OP_FIELD_1:
+            case OP_FIELD_2:
+            case OP_FIELD_3:
+            case OP_AD_FIELD:
+            case OP_AD_FIELD_0:
+            case OP_AD_FIELD_1:
+            case OP_AD_FIELD_2:
+            case OP_AD_FIELD_3:
+            {
+                unsigned int idx;
+                if(insn->opcode == OP_FIELD || insn->opcode == OP_AD_FIELD)
+                    idx = tvm_verify_ushort(v);
+                else if(insn->opcode <= OP_FIELD_3)
+                    idx = insn->opcode - OP_FIELD_0;
+                else idx = insn->opcode - OP_AD_FIELD_0;
+
+                insn->index = idx;
+                tvm_verify_field(v, insn, tvm_verify_pop(v), idx);
+                tvm_verify_push(v, insn->opcode <= OP_FIELD_3 ? insn->type : NULL);
+                break;
+            }
+
+            case OP_PT_FIELD:
+            case OP_PT_FIELD_0:
+            case OP_PT_FIELD_1:
+            case OP_PT_FIELD_2:
+            case OP_PT_FIELD_3:
+            case OP_AD_PT_FIELD:
+            case OP_AD_PT_FIELD_0:
+            case OP_AD_PT_FIELD_1:
+            case OP_AD_PT_FIELD_2:
+            case OP_AD_PT_FIELD_3:
+            {
+                unsigned int idx;
+                if(insn->opcode == OP_PT_FIELD || insn->opcode == OP_AD_PT_FIELD)
+                    idx = tvm_verify_ushort(v);
+                else if(insn->opcode <= OP_PT_FIELD_3)
+                    idx = insn->opcode - OP_PT_FIELD_0;
+                else idx = insn->opcode - OP_AD_PT_FIELD_0;
+
+                insn->index = idx;
+                tvm_verify_field(v, insn, tvm_verify_ref(v, tvm_verify_pop(v)), idx);
+                tvm_verify_push(v, insn->opcode <= OP_PT_FIELD_3 ? insn->type : NULL);
+                break;
+            }
+
+            case OP_PUSH:
+            insn->index = tvm_verify_local(v, 0);
+            insn->type = v->locals[insn->index];
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_PUSH_0:
+            case OP_PUSH_1:
+            case OP_PUSH_2:
+            case OP_PUSH_3:
+            insn->index = insn->opcode - OP_PUSH_0;
+            if(insn->index >= data->locals_num || !v->locals_declared[insn->index])
+                tvm_verify_fail(v, "use of an undeclared local");
+            insn->type = v->locals[insn->index];
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_PUSH_ARG:
+            case OP_PUSH_ARG_0:
+            case OP_PUSH_ARG_1:
+            case OP_PUSH_ARG_2:
+            case OP_PUSH_ARG_3:
+            if(insn->opcode == OP_PUSH_ARG)
+                insn->index = tvm_verify_ushort(v);
+            else insn->index = insn->opcode - OP_PUSH_ARG_0;
+            if(insn->index >= jit_type_num_params(v->signature))
+                tvm_verify_fail(v, "argument index out of range");
+            insn->type = jit_type_get_param(v->signature, insn->index);
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_PUSH_GBL:
+            case OP_STORE_GBL:
+            insn->index = tvm_verify_index(v, module->globals_len, "global index out of range");
+            insn->type = module->globals[insn->index].type;
+            insn->imm.ptr = module->globals[insn->index].data;
+            if(insn->opcode == OP_PUSH_GBL)
+                tvm_verify_push(v, insn->type);
+            else tvm_verify_pop(v);
+            break;
+
+            case OP_PUSH_E_GBL:
+            case OP_STORE_E_GBL:
+            insn->index = tvm_verify_index(v, module->ext_globals_len, "external global index out of range");
+            if(module->ext_globals[insn->index] == NULL)
+                tvm_verify_fail(v, "unresolved external global");
+            insn->type = module->ext_globals[insn->index]->type;
+            insn->imm.ptr = module->ext_globals[insn->index]->data;
+            if(insn->opcode == OP_PUSH_E_GBL)
+                tvm_verify_push(v, insn->type);
+            else tvm_verify_pop(v);
+            break;
+
+            case OP_POP:
+            tvm_verify_pop(v);
+            break;
+
+            case OP_DUP:
+            {
+                jit_type_t type = tvm_verify_pop(v);
+                tvm_verify_push(v, type);
+                tvm_verify_push(v, type);
+                break;
+            }
+
+            case OP_CLEAR:
+            v->depth = 0;
+            break;
+
+            case OP_DECL_I8:
+            case OP_DECL_U8:
+            case OP_DECL_I16:
+            case OP_DECL_U16:
+            case OP_DECL_I32:
+            case OP_DECL_U32:
+            case OP_DECL_I64:
+            case OP_DECL_U64:
+            case OP_DECL_F32:
+            case OP_DECL_F64:
+            case OP_DECL_VP:
+            case OP_DECL_PT:
+            case OP_DECL_ST:
+            case OP_DECL_E_ST:
+            case OP_DECL_T:
+            {
+                insn->index = tvm_verify_local(v, 1);
+
+                switch(insn->opcode)
+                {
+                    case OP_DECL_PT:
+                    insn->type = tvm_program_pointer_type(module->program, tvm_verify_type(v));
+                    break;
+
+                    case OP_DECL_T:
+                    insn->type = tvm_verify_type(v);
+                    break;
+
+                    case OP_DECL_ST:
+                    {
+                        jit_ushort idx = tvm_verify_index(v, module->structs_len, "struct index out of range");
+                        insn->type = module->structs[idx].type;
+                        break;
+                    }
+                    case OP_DECL_E_ST:
+                    {
+                        jit_ushort idx = tvm_verify_index(v, module->ext_structs_len, "external struct index out of range");
+                        if(module->ext_structs[idx] == NULL)
+                            tvm_verify_fail(v, "unresolved external struct");
+                        insn->type = module->ext_structs[idx]->type;
+                        break;
+                    }
+                    case OP_DECL_VP:
+                    insn->type = jit_type_void_ptr;
+                    break;
+
+                    default:
+                    //primitive types follow the typeids order
+                    insn->type = tvm_types_table[insn->opcode - OP_DECL_I8];
+                }
+
+                v->locals[insn->index] = insn->type;
+                v->locals_declared[insn->index] = 1;
+                break;
+            }
+
+            case OP_STORE:
+            case OP_STORE_VAL:
+            insn->index = tvm_verify_local(v, 0);
+            tvm_verify_pop(v);
+            break;
+
+            case OP_STORE_0:
+            case OP_STORE_1:
+            case OP_STORE_2:
+            case OP_STORE_3:
+            case OP_STORE_VAL_0:
+            case OP_STORE_VAL_1:
+            case OP_STORE_VAL_2:
+            case OP_STORE_VAL_3:
+            insn->index = insn->opcode <= OP_STORE_3 ? insn->opcode - OP_STORE_0 : insn->opcode - OP_STORE_VAL_0;
+            if(insn->index >= data->locals_num || !v->locals_declared[insn->index])
+                tvm_verify_fail(v, "use of an undeclared local");
+            tvm_verify_pop(v);
+            break;
+
+            case OP_SET_AT:
+            case OP_SET_AT_C:
+            case OP_SET_AT_0:
+            case OP_SET_AT_1:
+            case OP_SET_AT_2:
+            case OP_SET_AT_3:
+            {
+                if(insn->opcode == OP_SET_AT_C)
+                    insn->imm.nint = tvm_verify_uint(v);
+                else if(insn->opcode != OP_SET_AT)
+                    insn->imm.nint = insn->opcode - OP_SET_AT_0;
+
+                //pointer, index if not constant and value
+                tvm_verify_pop(v);
+                if(insn->opcode == OP_SET_AT)
+                    tvm_verify_pop(v);
+                insn->type = tvm_verify_ref(v, tvm_verify_pop(v));
+                break;
+            }
+
+            case OP_SET_FIELD:
+            case OP_SET_FIELD_0:
+            case OP_SET_FIELD_1:
+            case OP_SET_FIELD_2:
+            case OP_SET_FIELD_3:
+            {
+                //the struct is a local
+                jit_ushort local = tvm_verify_local(v, 0);
+                unsigned int idx;
+                if(insn->opcode == OP_SET_FIELD)
+                    idx = tvm_verify_ushort(v);
+                else idx = insn->opcode - OP_SET_FIELD_0;
+
+                //declared locals have always a type
+                insn->index = local;
+                tvm_verify_field(v, insn, v->locals[local], idx);
+                tvm_verify_pop(v);
+                break;
+            }
+
+            case OP_SET_PT_FIELD:
+            case OP_SET_PT_FIELD_0:
+            case OP_SET_PT_FIELD_1:
+            case OP_SET_PT_FIELD_2:
+            case OP_SET_PT_FIELD_3:
+            {
+                unsigned int idx;
+                if(insn->opcode == OP_SET_PT_FIELD)
+                    idx = tvm_verify_ushort(v);
+                else idx = insn->opcode - OP_SET_PT_FIELD_0;
+
+                insn->index = idx;
+                tvm_verify_pop(v);
+                tvm_verify_field(v, insn, tvm_verify_ref(v, tvm_verify_pop(v)), idx);
+                break;
+            }
+
+            case OP_S_ALLOC:
+            case OP_GC_ALLOC:
+            case OP_GC_ATOM_ALLOC:
+            tvm_verify_pop(v);
+            insn->type = jit_type_void_ptr;
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_S_ALLOC_C:
+            case OP_GC_ALLOC_C:
+            case OP_GC_ATOM_ALLOC_C:
+            insn->imm.nint = tvm_verify_uint(v);
+            insn->type = jit_type_void_ptr;
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_GC_ALLOC_ST:
+            case OP_GC_ARRAY_ST:
+            {
+                jit_ushort idx = tvm_verify_index(v, module->structs_len, "struct index out of range");
+                insn->imm.ptr = &module->structs[idx];
+                if(insn->opcode == OP_GC_ARRAY_ST)
+                    tvm_verify_pop(v);
+                insn->type = tvm_program_pointer_type(module->program, module->structs[idx].type);
+                tvm_verify_push(v, insn->type);
+                break;
+            }
+            case OP_GC_ALLOC_E_ST:
+            case OP_GC_ARRAY_E_ST:
+            {
+                jit_ushort idx = tvm_verify_index(v, module->ext_structs_len, "external struct index out of range");
+                if(module->ext_structs[idx] == NULL)
+                    tvm_verify_fail(v, "unresolved external struct");
+                insn->imm.ptr = module->ext_structs[idx];
+                if(insn->opcode == OP_GC_ARRAY_E_ST)
+                    tvm_verify_pop(v);
+                insn->type = tvm_program_pointer_type(module->program, module->ext_structs[idx]->type);
+                tvm_verify_push(v, insn->type);
+                break;
+            }
+
+            case OP_SPAWN:
+            insn->index = tvm_verify_index(v, module->funcs_len, "function index out of range");
+            insn->imm.ptr = module->funcs[insn->index];
+            insn->type = jit_function_get_signature(insn->imm.ptr);
+            tvm_verify_spawn(v, insn->type);
+            break;
+
+            case OP_E_SPAWN:
+            insn->index = tvm_verify_index(v, module->ext_funcs_len, "external function index out of range");
+            if(module->ext_funcs[insn->index] == NULL)
+                tvm_verify_fail(v, "unresolved external function");
+            insn->imm.ptr = *module->ext_funcs[insn->index];
+            insn->type = jit_function_get_signature(insn->imm.ptr);
+            tvm_verify_spawn(v, insn->type);
+            break;
+
+            case OP_JOIN:
+            tvm_verify_pop(v);
+            insn->type = jit_type_void_ptr;
+            tvm_verify_push(v, insn->type);
+            break;
+
+            case OP_CALL:
+            case OP_FUNC_AD:
+            insn->index = tvm_verify_index(v, module->funcs_len, "function index out of range");
+            insn->imm.ptr = module->funcs[insn->index];
+            insn->type = jit_function_get_signature(module->funcs[insn->index]);
+            if(insn->opcode == OP_CALL)
+                tvm_verify_call(v, insn->type);
+            else tvm_verify_push(v, jit_type_void_ptr);
+            break;
+
+            case OP_E_CALL:
+            case OP_E_FUNC_AD:
+            insn->index = tvm_verify_index(v, module->ext_funcs_len, "external function index out of range");
+            if(module->ext_funcs[insn->index] == NULL)
+                tvm_verify_fail(v, "unresolved external function");
+            insn->imm.ptr = *module->ext_funcs[insn->index];
+            insn->type = jit_function_get_signature(insn->imm.ptr);
+            if(insn->opcode == OP_E_CALL)
+                tvm_verify_call(v, insn->type);
+            else tvm_verify_push(v, jit_type_void_ptr);
+            break;
+
+            case OP_N_CALL:
+            case OP_N_FUNC_AD:
+            insn->index = tvm_verify_index(v, module->c_funcs_len, "native function index out of range");
+            insn->imm.ptr = module->c_funcs + insn->index;
+            insn->type = module->c_funcs[insn->index].signature;
+            if(insn->opcode == OP_N_CALL)
+                tvm_verify_call(v, insn->type);
+            else tvm_verify_push(v, jit_type_void_ptr);
+            break;
+
+            case OP_EN_CALL:
+            case OP_EN_FUNC_AD:
+            insn->index = tvm_verify_index(v, module->ext_c_funcs_len, "external native function index out of range");
+            if(module->ext_c_funcs[insn->index] == NULL)
+                tvm_verify_fail(v, "unresolved external native function");
+            insn->imm.ptr = module->ext_c_funcs[insn->index];
+            insn->type = module->ext_c_funcs[insn->index]->signature;
+            if(insn->opcode == OP_EN_CALL)
+                tvm_verify_call(v, insn->type);
+            else tvm_verify_push(v, jit_type_void_ptr);
+            break;
+
+            case OP_CALL_PT:
+            {
+                //inline signature: return type, parameters number and types
+                jit_type_t ret = tvm_verify_type(v);
+                jit_ushort params_num = tvm_verify_ushort(v);
+                jit_type_t* params = jit_malloc(sizeof(jit_type_t) * (params_num + 1));
+
+                int k;
+                for(k = 0; k < params_num; ++k)
+                    params[k] = tvm_verify_type(v);
+
+                insn->type = tvm_program_signature_type(module->program, ret, params, params_num);
+                jit_free(params);
+
+                //the function pointer is under the arguments
+                tvm_verify_pop_n(v, params_num);
+                tvm_verify_pop(v);
+
+                jit_type_t result = jit_type_get_return(insn->type);
+                if(jit_type_get_kind(result) != JIT_TYPE_VOID)
+                    tvm_verify_push(v, result);
+                break;
+            }
+
+            case OP_RET:
+            tvm_verify_pop(v);
+            break;
+
+            case OP_VAL_ASSIGN:
+            tvm_verify_pop_n(v, 2);
+            break;
+
+            case OP_SIZEOF:
+            {
+                jit_type_t type = tvm_verify_pop(v);
+                if(type != NULL)
+                    insn->imm.nint = jit_type_get_size(type);
+                insn->type = type;
+                tvm_verify_push(v, jit_type_nuint);
+                break;
+            }
+
+            case OP_SIZEOF_T:
+            case OP_SIZEOF_T_MUL:
+            insn->type = tvm_verify_type(v);
+            insn->imm.nint = jit_type_get_size(insn->type);
+            if(insn->opcode == OP_SIZEOF_T_MUL)
+                tvm_verify_pop(v);
+            tvm_verify_push(v, jit_type_nuint);
+            break;
+
+            case OP_MINUM:
+            case OP_INC:
+            case OP_DEC:
+            case OP_NOT:
+            {
+                //same type of the operand
+                jit_type_t type = tvm_verify_pop(v);
+                tvm_verify_push(v, type);
+                break;
+            }
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_REM:
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
+            case OP_SHL:
+            case OP_SHR:
+            //the result type follows libjit promotions
+            tvm_verify_pop_n(v, 2);
+            tvm_verify_push(v, NULL);
+            break;
+
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_GT:
+            case OP_GE:
+            tvm_verify_pop_n(v, 2);
+            tvm_verify_push(v, jit_type_int);
+            break;
+
+            case OP_NEG:
+            case OP_IS_NULL:
+            case OP_TO_BOOL:
+            case OP_TO_BOOL_N:
+            tvm_verify_pop(v);
+            tvm_verify_push(v, jit_type_int);
+            break;
+
+            case OP_JMP:
+            case OP_JMP_IF:
+            case OP_JMP_IF_N:
+            insn->index = tvm_verify_index(v, data->labels_num, "label index out of range");
+            if(v->labels_jumps[insn->index] == NULL)
+                v->labels_jumps[insn->index] = v->insn_begin;
+            if(insn->opcode != OP_JMP)
+                tvm_verify_pop(v);
+            break;
+
+            case OP_LABEL:
+            insn->index = tvm_verify_index(v, data->labels_num, "label index out of range");
+            if(v->labels_placed[insn->index])
+                tvm_verify_fail(v, "label placed twice");
+            v->labels_placed[insn->index] = 1;
+            break;
+
+            case OP_CAST_I8:
+            case OP_CAST_U8:
+            case OP_CAST_I16:
+            case OP_CAST_U16:
+            case OP_CAST_I32:
+            case OP_CAST_U32:
+            case OP_CAST_I64:
+            case OP_CAST_U64:
+            case OP_CAST_F32:
+            case OP_CAST_F64:
+            case OP_CAST_VP:
+            case OP_CAST_PT:
+            case OP_CAST_ST:
+            case OP_CAST_E_ST:
+            case OP_CAST_T:
+            {
+                switch(insn->opcode)
+                {
+                    case OP_CAST_PT:
+                    insn->type = tvm_program_pointer_type(module->program, tvm_verify_type(v));
+                    break;
+
+                    case OP_CAST_T:
+                    insn->type = tvm_verify_type(v);
+                    break;
+
+                    case OP_CAST_ST:
+                    {
+                        jit_ushort idx = tvm_verify_index(v, module->structs_len, "struct index out of range");
+                        insn->type = module->structs[idx].type;
+                        break;
+                    }
+                    case OP_CAST_E_ST:
+                    {
+                        jit_ushort idx = tvm_verify_index(v, module->ext_structs_len, "external struct index out of range");
+                        if(module->ext_structs[idx] == NULL)
+                            tvm_verify_fail(v, "unresolved external struct");
+                        insn->type = module->ext_structs[idx]->type;
+                        break;
+                    }
+                    case OP_CAST_VP:
+                    insn->type = jit_type_void_ptr;
+                    break;
+
+                    default:
+                    //primitive types follow the typeids order
+                    insn->type = tvm_types_table[insn->opcode - OP_CAST_I8];
+                }
+
+                tvm_verify_pop(v);
+                tvm_verify_push(v, insn->type);
+                break;
+            }
+
+            case OP_ABORT:
+            tvm_verify_pop(v);
+            break;
+
+            default:
+            tvm_verify_fail(v, "unrecognized opcode");
+        }
+
+        insn->pops = v->pops;
+        insn->pushes = v->pushes;
+        ++insn;
+    }
+
+    //libjit would emit a branch to an undefined label
+    int i;
+    for(i = 0; i < data->labels_num; ++i)
+    {
+        if(v->labels_jumps[i] != NULL && !v->labels_placed[i])
+        {
+            v->insn_begin = v->labels_jumps[i];
+            tvm_verify_fail(v, "jump to a label never placed");
+        }
+    }
+
+    data->insns = jit_realloc(insns, sizeof(tvm_insn_t) * (insn - insns + 1));
+    data->insns_end = data->insns + (insn - insns);
+    data->max_stack = v->max_depth;
+
+    jit_free(v->stack);
+    jit_free(v->locals);
+    jit_free(v->locals_declared);
+    jit_free(v->labels_placed);
+    jit_free(v->labels_jumps);
+}